@@ -0,0 +1,118 @@
+#include "tfs.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Find the mountpoint a path is on, the last directory up the tree on the same device.
+ */
+static char *mount_root(const char *path) {
+	struct stat st, parent_st;
+	char *root = realpath(path, NULL);
+
+	if (!root || stat(root, &st))
+		return NULL;
+	if (!S_ISDIR(st.st_mode))
+		dirname(root);
+
+	while (strcmp(root, "/")) {
+		char *parent = strdup(root);
+		dirname(parent);
+		if (stat(parent, &parent_st) || parent_st.st_dev != st.st_dev) {
+			free(parent);
+			break;
+		}
+		strcpy(root, parent);
+		free(parent);
+	}
+
+	return root;
+}
+
+/**
+ * Path of a file that may not exist yet, relative to the mountpoint `root`.
+ */
+static int fs_path(const char *root, const char *path, char *out) {
+	char *dir_copy = strdup(path), *base_copy = strdup(path);
+	char *dir = realpath(dirname(dir_copy), NULL);
+	char *base = basename(base_copy);
+	size_t len = strlen(root);
+	int ret = -1;
+
+	// Skip the mountpoint, but keep the slash after it.
+	if (dir && !strncmp(dir, root, len) && (dir[len] == '/' || dir[len] == '\0'))
+		if (snprintf(out, PATH_MAX, "%s/%s", dir + len, base) < PATH_MAX)
+			ret = 0;
+
+	free(dir);
+	free(dir_copy);
+	free(base_copy);
+
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	int opt, fd;
+	unsigned long cmd = TFS_IOC_CLONE;
+	struct tfs_ioctl_path arg;
+
+	while ((opt = getopt(argc, argv, "sd")) != -1) {
+		switch (opt) {
+		case 's':
+			cmd = TFS_IOC_SNAPSHOT;
+			break;
+		case 'd':
+			cmd = TFS_IOC_SNAPSHOT_DELETE;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 2) {
+	usage:
+		fprintf(stderr,
+		        "usage: %s <src> <dst>\n"
+		        "       %s -s <name> <mountpoint>\n"
+		        "       %s -d <name> <mountpoint>\n"
+		        "\n"
+		        "Clone the file `src` on a mounted TFS to `dst` on the same filesystem without copying data,\n"
+		        "the clones share blocks until they are written to.\n"
+		        "\n"
+		        "    -s    take a read-only snapshot of the whole filesystem, found under " SNAPSHOT_DIR "/`name`\n"
+		        "    -d    delete a snapshot\n"
+		        "\n"
+		        "Mount with `-o snapshots` when using snapshots, or the kernel may keep showing deleted ones.\n",
+		        argv[0], argv[0], argv[0]);
+		return 1;
+	}
+
+	if (cmd == TFS_IOC_CLONE) {
+		char *root = mount_root(argv[optind]);
+		if (!root || fs_path(root, argv[optind + 1], arg.path)) {
+			fprintf(stderr, "%s: not on the same filesystem as %s\n", argv[optind + 1], argv[optind]);
+			return 1;
+		}
+		free(root);
+		fd = open(argv[optind], O_RDONLY);
+	} else {
+		if (strlen(argv[optind]) >= PATH_MAX) {
+			fprintf(stderr, "%s: name too long\n", argv[optind]);
+			return 1;
+		}
+		strcpy(arg.path, argv[optind]);
+		fd = open(argv[optind + 1], O_RDONLY | O_DIRECTORY);
+	}
+
+	if (fd == -1 || ioctl(fd, cmd, &arg) == -1) {
+		perror(argv[0]);
+		return 1;
+	}
+	close(fd);
+
+	return 0;
+}
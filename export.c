@@ -0,0 +1,81 @@
+#include "tfs.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Streams are mostly whole blocks, so buffer generously.
+#define STREAM_BUFFER_SIZE (1 << 20)
+
+int main(int argc, char *argv[]) {
+	int opt, ret, restore = 0, incremental = 0;
+	uint64_t since = 0, generation;
+
+	while ((opt = getopt(argc, argv, "i:r")) != -1) {
+		switch (opt) {
+		case 'i':
+			incremental = 1;
+			since = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			restore = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 1 || (restore && incremental)) {
+	usage:
+		fprintf(stderr,
+		        "usage: %s [-i generation] <file> > export\n"
+		        "       %s -r <file> < export\n"
+		        "\n"
+		        "Export the allocated blocks and metadata of the TFS image `file` to standard output,\n"
+		        "or restore an export from standard input into `file`. `file` must not be mounted.\n"
+		        "\n"
+		        "    -i    only export what changed since the export of this generation\n"
+		        "    -r    restore; incremental exports apply on top of the image restored from\n"
+		        "          the export they were taken since\n",
+		        argv[0], argv[0]);
+		return 1;
+	}
+
+	if (restore) {
+		setvbuf(stdin, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+		ret = tfs_restore(stdin, argv[optind]);
+		if (ret == -ESTALE)
+			fprintf(stderr, "%s: export does not follow the one this image was restored from\n", argv[optind]);
+		else if (ret)
+			fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return ret ? 1 : 0;
+	}
+
+	if (isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "%s: refusing to write an export to a terminal\n", argv[0]);
+		return 1;
+	}
+
+	ret = tfs_open(argv[optind]);
+	if (!ret)
+		ret = tfs_init();
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+
+	setvbuf(stdout, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+	ret = tfs_export(stdout, incremental, since, &generation);
+	tfs_destroy();
+
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+
+	// Needed for the next incremental export.
+	fprintf(stderr, "exported generation %lu\n", generation);
+
+	return 0;
+}
@@ -6,12 +6,14 @@
 #include <libgen.h>
 #include <math.h>
 #include <search.h> // hsearch
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "tfs.h"
+#include "trace.h"
 
 static int fuse_tfs_getattr(const char *path, struct stat *stbuf) {
 	fprintf(stderr, "getattr %s\n", path);
@@ -24,8 +26,7 @@ static int fuse_tfs_getattr(const char *path, struct stat *stbuf) {
 	stbuf->st_mode = node->mode;
 	stbuf->st_nlink = (node->mode & S_IFDIR) ? node->nlink + 1 : 1;
 	stbuf->st_size = NODE_SIZE(node);
-	stbuf->st_atim = node->atim;
-	stbuf->st_mtim = node->mtim;
+	tfs_node_times(node, &stbuf->st_atim, &stbuf->st_mtim);
 
 	return 0;
 }
@@ -73,9 +74,7 @@ static int fuse_tfs_truncate(const char *path, off_t size) {
 	if (node->mode & S_IFDIR)
 		return -EISDIR;
 
-	node->size = size;
-
-	return tfs_node_trim(node);
+	return tfs_node_truncate(node, size);
 }
 
 static int fuse_tfs_open(const char *path, struct fuse_file_info *fi) {
@@ -83,6 +82,9 @@ static int fuse_tfs_open(const char *path, struct fuse_file_info *fi) {
 	if (!get_node(path))
 		return -ENOENT;
 
+	// File data only changes through write, so whatever the kernel cached is still good.
+	fi->keep_cache = 1;
+
 	return 0;
 }
 
@@ -125,20 +127,32 @@ static int fuse_tfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	filler(buf, ".", NULL, 0);
 	filler(buf, "..", NULL, 0);
 
-	struct tfs_node **children = tfs_node_children(node);
+	struct tfs_dirent *children = tfs_node_children(node);
 
-	for (int i = 0; i < node->nlink; i++) {
-		struct tfs_node *child = children[i];
-
-		filler(buf, child->name, NULL, 0);
-	}
+	for (int i = 0; i < node->nlink; i++)
+		filler(buf, children[i].name, NULL, 0);
 
 	free(children);
 
 	return 0;
 }
 
+static int fuse_tfs_statfs(const char *path, struct statvfs *stbuf) {
+	fprintf(stderr, "statfs %s\n", path);
+	tfs_statfs(stbuf);
+	return 0;
+}
+
+static void *fuse_tfs_init(struct fuse_conn_info *conn) {
+	// Let the kernel send writes bigger than a page.
+	conn->want |= FUSE_CAP_BIG_WRITES;
+	// Snapshots are taken through an ioctl on the mountpoint.
+	conn->want |= FUSE_CAP_IOCTL_DIR;
+	return NULL;
+}
+
 static void fuse_tfs_destroy(void *data) {
+	tfs_trace_close();
 	tfs_destroy();
 	hdestroy();
 }
@@ -149,22 +163,78 @@ static int fuse_tfs_utimens(const char *path, const struct timespec tv[2]) {
 	if (!node)
 		return -ENOENT;
 
-	node->atim = tv[0];
-	node->mtim = tv[1];
+	return tfs_node_utimens(node, tv);
+}
+
+static int fuse_tfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags,
+                          void *data) {
+	fprintf(stderr, "ioctl %s\n", path);
+	struct tfs_ioctl_path *ioc = data;
+
+	if (flags & FUSE_IOCTL_COMPAT)
+		return -ENOSYS;
+
+	switch (cmd) {
+	case TFS_IOC_CLONE:
+		ioc->path[PATH_MAX - 1] = '\0';
+		return tfs_clone(path, ioc->path);
+	case TFS_IOC_SNAPSHOT:
+		ioc->path[PATH_MAX - 1] = '\0';
+		return tfs_snapshot(ioc->path);
+	case TFS_IOC_SNAPSHOT_DELETE:
+		ioc->path[PATH_MAX - 1] = '\0';
+		return tfs_snapshot_delete(ioc->path);
+	}
+
+	return -ENOTTY;
+}
+
+static int fuse_tfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	fprintf(stderr, "fsync %s\n", path);
+	if (!datasync)
+		tfs_flush_times();
 
 	return 0;
 }
 
+/*
+ * Regular operations all go through the kernel, so it may cache lookups and attributes for long.
+ * Given before the user's own options so those still take precedence.
+ */
+#define CACHE_OPTIONS "-oentry_timeout=3600,attr_timeout=3600"
+/*
+ * Snapshots are taken and deleted through ioctls the kernel knows nothing about, and libfuse 2.9
+ * can't tell it to drop entries, so don't let them outlive a deleted snapshot for long.
+ */
+#define SNAPSHOT_CACHE_OPTIONS "-oentry_timeout=1,attr_timeout=1"
+
 struct tfs_config {
 	char *tfs_file_path;
+	char *trace_path;
+	int flags;
+	int snapshots;
 };
 
 enum {
 	KEY_HELP,
+	KEY_STRICTATIME,
+	KEY_RELATIME,
+	KEY_NOATIME,
+	KEY_LAZYTIME,
+	KEY_RO,
 };
 
-// We intercept the help flag.
-static struct fuse_opt tfs_opts[] = {FUSE_OPT_KEY("-h", KEY_HELP), FUSE_OPT_KEY("--help", KEY_HELP), FUSE_OPT_END};
+// We intercept the help flag and the timestamp options.
+static struct fuse_opt tfs_opts[] = {FUSE_OPT_KEY("-h", KEY_HELP),
+                                     FUSE_OPT_KEY("--help", KEY_HELP),
+                                     FUSE_OPT_KEY("strictatime", KEY_STRICTATIME),
+                                     FUSE_OPT_KEY("relatime", KEY_RELATIME),
+                                     FUSE_OPT_KEY("noatime", KEY_NOATIME),
+                                     FUSE_OPT_KEY("lazytime", KEY_LAZYTIME),
+                                     FUSE_OPT_KEY("ro", KEY_RO),
+                                     {"trace=%s", offsetof(struct tfs_config, trace_path), 0},
+                                     {"snapshots", offsetof(struct tfs_config, snapshots), 1},
+                                     FUSE_OPT_END};
 
 static int tfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
 	struct tfs_config *config = data;
@@ -174,11 +244,47 @@ static int tfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *
 		fprintf(stderr,
 		        "usage: %s file mountpoint [fuse options]\n"
 		        "\n"
-		        "`file` must exist and must be initialized with `mktfs`."
+		        "`file` must exist and must be initialized with `mktfs`.\n"
+		        "Images striped across several files are given as `file1:file2:...`.\n"
+		        "\n"
+		        "TFS options:\n"
+		        "    -o strictatime         update atime on every read (default)\n"
+		        "    -o relatime            update atime only if older than mtime or a day\n"
+		        "    -o noatime             never update atime\n"
+		        "    -o lazytime            keep timestamps in memory and write them back in batches\n"
+		        "    -o trace=FILE          record all operations to FILE for `tfs-replay`\n"
+		        "    -o ro                  map `file` read-only and never write to it,\n"
+		        "                           uses the lookup index built by `mktfs -i` if there is one\n"
+		        "    -o snapshots           cache entries and attributes for a second instead of an hour,\n"
+		        "                           the default for images that already have snapshots\n"
+		        "\n"
+		        "Files are cloned and snapshots taken with `tfs-clone` while mounted.\n"
+		        "\n"
+		        "Entries and attributes are cached by the kernel for an hour by default,\n"
+		        "so do not modify `file` with other tools while it is mounted.\n"
+		        "Taking or deleting snapshots also changes `file` behind the kernel's back,\n"
+		        "so deleted snapshots may still show for up to the cache time. Mount with\n"
+		        "`-o snapshots` before taking the first snapshot of an image.\n"
 		        "\n"
 		        "See fuse(8) for more options.\n",
 		        outargs->argv[0]);
 		return -1;
+	case KEY_STRICTATIME:
+		config->flags &= ~(TFS_RELATIME | TFS_NOATIME);
+		return 0;
+	case KEY_RELATIME:
+		config->flags = (config->flags & ~TFS_NOATIME) | TFS_RELATIME;
+		return 0;
+	case KEY_NOATIME:
+		config->flags = (config->flags & ~TFS_RELATIME) | TFS_NOATIME;
+		return 0;
+	case KEY_LAZYTIME:
+		config->flags |= TFS_LAZYTIME;
+		return 0;
+	case KEY_RO:
+		config->flags |= TFS_RDONLY;
+		// Keep it, the kernel should know too.
+		return 1;
 	case FUSE_OPT_KEY_NONOPT:
 		if (config->tfs_file_path)
 			return 1;
@@ -201,12 +307,131 @@ static struct fuse_operations fuse_tfs_oper = {.getattr = fuse_tfs_getattr,
                                                .write = fuse_tfs_write,
                                                .release = fuse_tfs_release,
                                                .readdir = fuse_tfs_readdir,
+                                               .statfs = fuse_tfs_statfs,
+                                               .fsync = fuse_tfs_fsync,
+                                               .init = fuse_tfs_init,
                                                .destroy = fuse_tfs_destroy,
-                                               .utimens = fuse_tfs_utimens};
+                                               .utimens = fuse_tfs_utimens,
+                                               .ioctl = fuse_tfs_ioctl};
+
+/*
+ * Tracing wrappers, used instead of the plain operations when tracing.
+ */
+
+#define TRACE(op, path, arg, offset, call)                                                                             \
+	do {                                                                                                               \
+		uint64_t start = tfs_trace_now();                                                                              \
+		int ret = call;                                                                                                \
+		tfs_trace_record(op, path, arg, offset, start, ret);                                                           \
+		return ret;                                                                                                    \
+	} while (0)
+
+static int traced_getattr(const char *path, struct stat *stbuf) {
+	TRACE(TRACE_GETATTR, path, 0, 0, fuse_tfs_getattr(path, stbuf));
+}
+
+static int traced_mknod(const char *path, mode_t mode, dev_t rdev) {
+	TRACE(TRACE_MKNOD, path, mode, 0, fuse_tfs_mknod(path, mode, rdev));
+}
+
+static int traced_mkdir(const char *path, mode_t mode) {
+	TRACE(TRACE_MKDIR, path, mode, 0, fuse_tfs_mkdir(path, mode));
+}
+
+static int traced_unlink(const char *path) {
+	TRACE(TRACE_UNLINK, path, 0, 0, fuse_tfs_unlink(path));
+}
+
+static int traced_rmdir(const char *path) {
+	TRACE(TRACE_RMDIR, path, 0, 0, fuse_tfs_rmdir(path));
+}
+
+static int traced_truncate(const char *path, off_t size) {
+	TRACE(TRACE_TRUNCATE, path, size, 0, fuse_tfs_truncate(path, size));
+}
+
+static int traced_open(const char *path, struct fuse_file_info *fi) {
+	TRACE(TRACE_OPEN, path, 0, 0, fuse_tfs_open(path, fi));
+}
+
+static int traced_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	TRACE(TRACE_READ, path, size, offset, fuse_tfs_read(path, buf, size, offset, fi));
+}
+
+static int traced_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	TRACE(TRACE_WRITE, path, size, offset, fuse_tfs_write(path, buf, size, offset, fi));
+}
+
+static int traced_release(const char *path, struct fuse_file_info *fi) {
+	TRACE(TRACE_RELEASE, path, 0, 0, fuse_tfs_release(path, fi));
+}
+
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                          struct fuse_file_info *fi) {
+	TRACE(TRACE_READDIR, path, 0, offset, fuse_tfs_readdir(path, buf, filler, offset, fi));
+}
+
+static int traced_statfs(const char *path, struct statvfs *stbuf) {
+	TRACE(TRACE_STATFS, path, 0, 0, fuse_tfs_statfs(path, stbuf));
+}
+
+static int traced_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	TRACE(TRACE_FSYNC, path, datasync, 0, fuse_tfs_fsync(path, datasync, fi));
+}
+
+static int traced_utimens(const char *path, const struct timespec tv[2]) {
+	TRACE(TRACE_UTIMENS, path, 0, 0, fuse_tfs_utimens(path, tv));
+}
+
+static int traced_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags,
+                        void *data) {
+	struct tfs_ioctl_path *ioc = data;
+	char paths[TRACE_PATH_MAX];
+	uint64_t start = tfs_trace_now();
+	int ret = fuse_tfs_ioctl(path, cmd, arg, fi, flags, data);
+
+	// Anything else never got to TFS.
+	if (flags & FUSE_IOCTL_COMPAT)
+		return ret;
+
+	switch (cmd) {
+	case TFS_IOC_CLONE:
+		// Both paths, so replay knows where to clone to.
+		snprintf(paths, sizeof(paths), "%s%s", path, ioc->path);
+		tfs_trace_record(TRACE_CLONE, paths, strlen(path), 0, start, ret);
+		break;
+	case TFS_IOC_SNAPSHOT:
+		tfs_trace_record(TRACE_SNAPSHOT, ioc->path, 0, 0, start, ret);
+		break;
+	case TFS_IOC_SNAPSHOT_DELETE:
+		tfs_trace_record(TRACE_SNAPSHOT_DELETE, ioc->path, 0, 0, start, ret);
+		break;
+	}
+
+	return ret;
+}
+
+static struct fuse_operations traced_tfs_oper = {.getattr = traced_getattr,
+                                                 .mknod = traced_mknod,
+                                                 .mkdir = traced_mkdir,
+                                                 .unlink = traced_unlink,
+                                                 .rmdir = traced_rmdir,
+                                                 .truncate = traced_truncate,
+                                                 .open = traced_open,
+                                                 .read = traced_read,
+                                                 .write = traced_write,
+                                                 .release = traced_release,
+                                                 .readdir = traced_readdir,
+                                                 .statfs = traced_statfs,
+                                                 .fsync = traced_fsync,
+                                                 .init = fuse_tfs_init,
+                                                 .destroy = fuse_tfs_destroy,
+                                                 .utimens = traced_utimens,
+                                                 .ioctl = traced_ioctl};
 
 int main(int argc, char *argv[]) {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-	struct tfs_config config = {.tfs_file_path = NULL};
+	struct tfs_config config = {.tfs_file_path = NULL, .trace_path = NULL, .flags = 0, .snapshots = 0};
 
 	if (fuse_opt_parse(&args, &config, tfs_opts, tfs_opt_proc) == -1)
 		return 1;
@@ -216,9 +441,24 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	int ret = tfs_load(config.tfs_file_path);
+	int ret = tfs_load(config.tfs_file_path, config.flags);
 	if (ret)
 		return ret;
 
+	if (config.snapshots || get_node(SNAPSHOT_DIR))
+		fuse_opt_insert_arg(&args, 1, SNAPSHOT_CACHE_OPTIONS);
+	else
+		fuse_opt_insert_arg(&args, 1, CACHE_OPTIONS);
+
+	if (config.trace_path) {
+		ret = tfs_trace_open(config.trace_path);
+		if (ret) {
+			fprintf(stderr, "tfs: cannot open trace file %s\n", config.trace_path);
+			return 1;
+		}
+
+		return fuse_main(args.argc, args.argv, &traced_tfs_oper, NULL);
+	}
+
 	return fuse_main(args.argc, args.argv, &fuse_tfs_oper, NULL);
 }
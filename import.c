@@ -0,0 +1,227 @@
+#define _XOPEN_SOURCE 700
+#include "tfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Largest run of blocks read in one go.
+#define MAX_RUN_SIZE (8 << 20)
+
+/**
+ * A file whose data is still to be copied into the image.
+ */
+struct copy_job {
+	char *host_path;
+	struct tfs_node *node;
+};
+
+static struct copy_job *jobs;
+static size_t njobs, jobs_cap;
+static size_t next_job;
+static pthread_mutex_t next_job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Directories get their timestamps back once all children are added.
+ */
+struct dir_times {
+	struct tfs_node *node;
+	struct timespec tv[2];
+};
+
+static struct dir_times *dirs;
+static size_t ndirs, dirs_cap;
+
+static const char *host_root;
+static int errors;
+
+#define GROW(array, n, cap)                                                                                            \
+	do {                                                                                                               \
+		if ((n) == (cap)) {                                                                                            \
+			(cap) = (cap) ? (cap)*2 : 1024;                                                                            \
+			(array) = realloc((array), (cap) * sizeof(*(array)));                                                      \
+			if (!(array)) {                                                                                            \
+				perror("tfs-import");                                                                                  \
+				exit(1);                                                                                               \
+			}                                                                                                          \
+		}                                                                                                              \
+	} while (0)
+
+/**
+ * nftw() callback creating every directory and (pre-sized) file in the image.
+ */
+static int create_node(const char *host_path, const struct stat *st, int type, struct FTW *ftw) {
+	const char *path = host_path + strlen(host_root);
+	struct tfs_node *node;
+	int ret;
+
+	// The root already exists.
+	if (ftw->level == 0)
+		return 0;
+
+	switch (type) {
+	case FTW_D:
+		ret = tfs_add_node(path, S_IFDIR | (st->st_mode & 07777));
+		if (ret && ret != -EEXIST)
+			break;
+
+		node = get_node(path);
+		GROW(dirs, ndirs, dirs_cap);
+		dirs[ndirs++] = (struct dir_times){node, {st->st_atim, st->st_mtim}};
+		return 0;
+	case FTW_F:
+		if (!S_ISREG(st->st_mode)) {
+			fprintf(stderr, "tfs-import: skipping %s, not a regular file\n", host_path);
+			return 0;
+		}
+
+		ret = tfs_add_node(path, S_IFREG | (st->st_mode & 07777));
+		if (ret)
+			break;
+
+		// Allocate everything up front so each file gets contiguous runs of blocks.
+		node = get_node(path);
+		ret = tfs_node_truncate(node, st->st_size);
+		tfs_node_utimens(node, (struct timespec[2]){st->st_atim, st->st_mtim});
+
+		GROW(jobs, njobs, jobs_cap);
+		jobs[njobs++] = (struct copy_job){strdup(host_path), node};
+		if (ret)
+			break;
+		return 0;
+	case FTW_SL:
+		fprintf(stderr, "tfs-import: skipping %s, symbolic links are not supported\n", host_path);
+		return 0;
+	default:
+		fprintf(stderr, "tfs-import: cannot read %s\n", host_path);
+		errors++;
+		return 0;
+	}
+
+	fprintf(stderr, "tfs-import: %s: %s\n", host_path, strerror(-ret));
+	errors++;
+
+	// Out of space means nothing else will fit either.
+	return ret == -ENOSPC;
+}
+
+/**
+ * Copy a file's data straight into its blocks.
+ */
+static int copy_file(struct copy_job *job) {
+	size_t block_size = tfs_block_size();
+	int fd = open(job->host_path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	off_t size = job->node->size;
+	blkoff_t i = 0, count;
+
+	for (off_t offset = 0; offset < size; offset += count * block_size, i += count) {
+		char *data = tfs_node_map(job->node, i, MAX_RUN_SIZE / block_size, &count);
+		size_t to_read = MIN(count * block_size, size - offset);
+
+		for (off_t pos = offset; to_read > 0;) {
+			ssize_t n = pread(fd, data, to_read, pos);
+			if (n <= 0) {
+				close(fd);
+				// Zero means the file shrank under us.
+				return n ? -errno : -EIO;
+			}
+			data += n;
+			pos += n;
+			to_read -= n;
+		}
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static void *copy_worker(void *arg) {
+	for (;;) {
+		pthread_mutex_lock(&next_job_lock);
+		size_t i = next_job++;
+		pthread_mutex_unlock(&next_job_lock);
+
+		if (i >= njobs)
+			return NULL;
+
+		int ret = copy_file(&jobs[i]);
+		if (ret) {
+			fprintf(stderr, "tfs-import: %s: %s\n", jobs[i].host_path, strerror(-ret));
+			__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int opt, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 2 || nthreads < 1) {
+	usage:
+		fprintf(stderr,
+		        "usage: %s [-j threads] <file> <directory>\n"
+		        "\n"
+		        "Copy the contents of `directory` into the TFS image `file` without mounting it.\n"
+		        "`file` must be initialized with `mktfs` and must not be mounted.\n"
+		        "\n"
+		        "    -j    number of threads copying file data (default: number of CPUs)\n",
+		        argv[0]);
+		return 1;
+	}
+
+	int ret = tfs_load(argv[optind], 0);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+
+	// Strip trailing slashes so host paths minus the root are TFS paths.
+	char *root = strdup(argv[optind + 1]);
+	for (size_t len = strlen(root); len > 1 && root[len - 1] == '/'; len--)
+		root[len - 1] = '\0';
+	host_root = root;
+
+	// Single-threaded, TFS metadata is not thread safe.
+	if (nftw(root, create_node, 64, FTW_PHYS) == -1) {
+		perror(root);
+		errors++;
+	}
+
+	for (size_t i = 0; i < ndirs; i++)
+		tfs_node_utimens(dirs[i].node, dirs[i].tv);
+
+	// Data goes to disjoint blocks, so that part is parallel.
+	pthread_t threads[nthreads];
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, copy_worker, NULL);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (size_t i = 0; i < njobs; i++)
+		free(jobs[i].host_path);
+	free(jobs);
+	free(dirs);
+	free(root);
+
+	tfs_destroy();
+
+	return errors ? 1 : 0;
+}
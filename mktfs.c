@@ -1,27 +1,121 @@
 #include "tfs.h"
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+/**
+ * Parse a size with an optional K or M suffix.
+ */
+static size_t parse_size(const char *arg) {
+	char *end;
+	size_t size = strtoul(arg, &end, 0);
+
+	switch (*end) {
+	case 'k':
+	case 'K':
+		size <<= 10;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		size <<= 20;
+		end++;
+		break;
+	}
+
+	return *end ? 0 : size;
+}
+
+/**
+ * Join arguments into a colon separated list of files.
+ */
+static char *join_files(int n, char *files[]) {
+	size_t len = 0;
+
+	for (int i = 0; i < n; i++)
+		len += strlen(files[i]) + 1;
+
+	char *list = calloc(len + 1, 1);
+	for (int i = 0; i < n; i++) {
+		if (i)
+			strcat(list, ":");
+		strcat(list, files[i]);
+	}
+
+	return list;
+}
 
 int main(int argc, char *argv[]) {
-	int ret = 0;
+	int ret = 0, opt, grow = 0, index = 0;
+	size_t block_size = DEFAULT_BLOCK_SIZE, stripe_size = 0;
+
+	while ((opt = getopt(argc, argv, "b:s:gi")) != -1) {
+		switch (opt) {
+		case 'b':
+			block_size = parse_size(optarg);
+			break;
+		case 's':
+			stripe_size = parse_size(optarg);
+			break;
+		case 'g':
+			grow = 1;
+			break;
+		case 'i':
+			index = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
 
-	if (argc < 2) {
+	if (optind >= argc || (grow && argc - optind < 2) || (index && (grow || argc - optind != 1))) {
+	usage:
 		fprintf(stderr,
-		        "usage: %s <file>\n"
+		        "usage: %s [-b block_size] [-s stripe_size] <file>...\n"
+		        "       %s -g <file>[:<file>...] <new file>...\n"
+		        "       %s -i <file>[:<file>...]\n"
 		        "\n"
-		        "Allocate space to a file using fallocate(1) first.\n",
-		        argv[0]);
+		        "Allocate space to the files using fallocate(1) first.\n"
+		        "Given several files, blocks are striped across them. Mount them as `file1:file2:...`,\n"
+		        "in the same order.\n"
+		        "\n"
+		        "    -b    block size, a power of 2 from 4K to 1M (default 4K)\n"
+		        "    -s    stripe size, a power of 2 of at least the block size (default 64K)\n"
+		        "    -g    grow the existing image by striping new blocks across the new files\n"
+		        "    -i    build the lookup index used by read-only mounts of an existing image,\n"
+		        "          any later change to its paths drops the index again\n",
+		        argv[0], argv[0], argv[0]);
 		return 1;
 	}
 
-	ret = tfs_open(argv[1]);
+	char *files = join_files(argc - optind - grow, &argv[optind + grow]);
+
+	if (grow) {
+		ret = tfs_open(argv[optind]);
+		if (!ret)
+			ret = tfs_init();
+		if (!ret)
+			ret = tfs_grow(files);
+	} else if (index) {
+		ret = tfs_open(files);
+		if (!ret)
+			ret = tfs_init();
+		if (!ret)
+			ret = tfs_build_index();
+	} else {
+		ret = tfs_open(files);
+		if (!ret)
+			ret = tfs_format(block_size, stripe_size ? stripe_size : MAX(block_size, DEFAULT_STRIPE_SIZE));
+	}
+
 	if (ret)
-		return ret;
+		fprintf(stderr, "%s: %s\n", files, strerror(-ret));
 
-	tfs_format();
 	tfs_destroy();
+	free(files);
 
-	return 0;
+	return ret ? 1 : 0;
 }
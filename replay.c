@@ -0,0 +1,250 @@
+#include "tfs.h"
+#include "trace.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Latencies of one kind of operation.
+ */
+struct latencies {
+	uint64_t *ns;
+	size_t n, cap;
+};
+
+static struct latencies latencies[TRACE_NOPS];
+
+static void add_latency(enum tfs_trace_op op, uint64_t ns) {
+	struct latencies *l = &latencies[op];
+
+	if (l->n == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 1024;
+		l->ns = realloc(l->ns, l->cap * sizeof(uint64_t));
+		if (!l->ns) {
+			perror("tfs-replay");
+			exit(1);
+		}
+	}
+
+	l->ns[l->n++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+#define PERCENTILE(l, p) ((l)->ns[MIN((l)->n - 1, (size_t)((l)->n * (p)))] / 1000.0)
+
+static void report(uint64_t elapsed) {
+	size_t total = 0;
+
+	printf("%-10s %10s %10s %10s %10s %10s %10s\n", "op", "count", "p50 us", "p90 us", "p99 us", "p99.9 us",
+	       "max us");
+
+	for (int op = 0; op < TRACE_NOPS; op++) {
+		struct latencies *l = &latencies[op];
+		if (!l->n)
+			continue;
+
+		qsort(l->ns, l->n, sizeof(uint64_t), cmp_u64);
+		printf("%-10s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", tfs_trace_op_names[op], l->n, PERCENTILE(l, 0.5),
+		       PERCENTILE(l, 0.9), PERCENTILE(l, 0.99), PERCENTILE(l, 0.999), l->ns[l->n - 1] / 1000.0);
+		total += l->n;
+		free(l->ns);
+	}
+
+	printf("\n%zu ops in %.3f s (%.0f ops/s)\n", total, elapsed / 1e9, total / (elapsed / 1e9));
+}
+
+/**
+ * Make sure the scratch buffer for reads and writes can hold `size` bytes.
+ */
+static char *scratch(size_t size) {
+	static char *buf;
+	static size_t cap;
+
+	if (size > cap) {
+		free(buf);
+		buf = malloc(size);
+		if (!buf) {
+			perror("tfs-replay");
+			exit(1);
+		}
+		// Writes replay a recognisable pattern rather than uninitialized memory.
+		memset(buf, 0xA5, size);
+		cap = size;
+	}
+
+	return buf;
+}
+
+/**
+ * Perform one traced operation directly against TFS, like fuse_tfs.c would.
+ */
+static int replay(struct tfs_trace_record *record, const char *path) {
+	struct tfs_node *node;
+	struct timespec tv[2];
+	struct statvfs stvfs;
+	char src[PATH_MAX];
+
+	switch (record->op) {
+	case TRACE_MKNOD:
+		return tfs_add_node(path, record->arg);
+	case TRACE_MKDIR:
+		return tfs_add_node(path, record->arg | S_IFDIR);
+	case TRACE_STATFS:
+		tfs_statfs(&stvfs);
+		return 0;
+	case TRACE_CLONE:
+		if (record->arg > record->pathlen || record->arg >= PATH_MAX)
+			return -EINVAL;
+		snprintf(src, sizeof(src), "%.*s", (int)record->arg, path);
+		return tfs_clone(src, path + record->arg);
+	case TRACE_SNAPSHOT:
+		return tfs_snapshot(path);
+	case TRACE_SNAPSHOT_DELETE:
+		return tfs_snapshot_delete(path);
+	}
+
+	node = get_node(path);
+	if (!node)
+		return -ENOENT;
+
+	switch (record->op) {
+	case TRACE_GETATTR:
+		tfs_node_times(node, &tv[0], &tv[1]);
+		return 0;
+	case TRACE_UNLINK:
+		if (node->mode & S_IFDIR)
+			return -EISDIR;
+		return tfs_remove_node(path);
+	case TRACE_RMDIR:
+		if (!(node->mode & S_IFDIR))
+			return -ENOTDIR;
+		if (node->nlink > 0)
+			return -ENOTEMPTY;
+		return tfs_remove_node(path);
+	case TRACE_TRUNCATE:
+		if (node->mode & S_IFDIR)
+			return -EISDIR;
+		return tfs_node_truncate(node, record->arg);
+	case TRACE_READ:
+		if (node->mode & S_IFDIR)
+			return -EISDIR;
+		return tfs_node_read(node, scratch(record->arg), record->arg, record->offset);
+	case TRACE_WRITE:
+		if (node->mode & S_IFDIR)
+			return -EISDIR;
+		return tfs_node_write(node, scratch(record->arg), record->arg, record->offset);
+	case TRACE_READDIR:
+		if (node->mode & S_IFREG)
+			return -ENOTDIR;
+		free(tfs_node_children(node));
+		return 0;
+	case TRACE_UTIMENS:
+		clock_gettime(CLOCK_REALTIME, &tv[0]);
+		tv[1] = tv[0];
+		return tfs_node_utimens(node, tv);
+	case TRACE_FSYNC:
+		if (!record->arg)
+			tfs_flush_times();
+		return 0;
+	}
+
+	// open, release
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int opt, timed = 0, flags = 0;
+	size_t mismatches = 0;
+
+	while ((opt = getopt(argc, argv, "tnrl")) != -1) {
+		switch (opt) {
+		case 't':
+			timed = 1;
+			break;
+		case 'n':
+			flags |= TFS_NOATIME;
+			break;
+		case 'r':
+			flags |= TFS_RELATIME;
+			break;
+		case 'l':
+			flags |= TFS_LAZYTIME;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 2) {
+	usage:
+		fprintf(stderr,
+		        "usage: %s [-t] [-n] [-r] [-l] <file> <trace>\n"
+		        "\n"
+		        "Replay a trace recorded with `tfs -o trace=<trace>` against the image `file`.\n"
+		        "The image is modified, so replay against a copy of the image the trace was recorded on.\n"
+		        "\n"
+		        "    -t    keep the original timing between operations instead of going full speed\n"
+		        "    -n    noatime\n"
+		        "    -r    relatime\n"
+		        "    -l    lazytime\n",
+		        argv[0]);
+		return 1;
+	}
+
+	FILE *trace = tfs_trace_read_open(argv[optind + 1]);
+	if (!trace) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	int ret = tfs_load(argv[optind], flags);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+
+	struct tfs_trace_record record;
+	char path[TRACE_PATH_MAX];
+	uint64_t begin = tfs_trace_now();
+
+	while ((ret = tfs_trace_read(trace, &record, path)) > 0) {
+		if (timed) {
+			uint64_t elapsed = tfs_trace_now() - begin;
+			if (record.start > elapsed) {
+				uint64_t wait = record.start - elapsed;
+				struct timespec ts = {.tv_sec = wait / 1000000000, .tv_nsec = wait % 1000000000};
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		uint64_t start = tfs_trace_now();
+		int result = replay(&record, path);
+		add_latency(record.op, tfs_trace_now() - start);
+
+		// Diverging results mean the image did not match the one traced.
+		if (result != record.ret)
+			mismatches++;
+	}
+
+	uint64_t elapsed = tfs_trace_now() - begin;
+	fclose(trace);
+
+	if (ret < 0)
+		fprintf(stderr, "tfs-replay: trace is malformed, stopped early\n");
+	if (mismatches)
+		fprintf(stderr, "tfs-replay: %zu operations returned differently than when traced\n", mismatches);
+
+	report(elapsed);
+	tfs_destroy();
+
+	return 0;
+}
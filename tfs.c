@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
 #include <math.h>
 #include <search.h>
 #include <stdio.h>
@@ -12,23 +13,71 @@
 
 static struct tfs_info tfs_info;
 
+// Block geometry of the loaded image.
+#define BLOCK_SIZE (tfs_info.block_size)
+#define BLOCK_SIZE_NBITS (tfs_info.block_nbits)
+#define BLOCK_MAX_CHILDREN (tfs_info.max_children)
+#define BLOCK_MAX_POINTERS (tfs_info.max_pointers)
+#define MAX_POINTERS_NBITS (tfs_info.max_pointers_nbits)
+// Block index and offset within that block of a byte offset.
+#define BLOCK_INDEX(offset) ((offset) >> BLOCK_SIZE_NBITS)
+#define BLOCK_OFFSET(offset) ((offset) & (BLOCK_SIZE - 1))
+// Number required blocks for data (not including indirect pointer blocks)
+#define NODE_NRBLOCKS(node) BLOCK_INDEX(BLOCK_SIZE + NODE_SIZE(node) - 1)
+
 // Node number from pointer.
 #define NODENO(node) ((node)-tfs_info.nodes)
-// Block number from pointer.
-#define BLOCKNO(block) ((block)-tfs_info.data)
-// Cast block data to an array of node offsets.
-#define BLOCK_NODES(block) ((nodoff_t *)(tfs_info.data[block]))
+// Block pointers of a node.
+#define NODE_POINTERS(node) (&tfs_info.pointers[NODENO(node)])
+// Pointer to block data.
+#define BLOCK(block) block_data(block)
+// Cast block data to an array of directory entries.
+#define BLOCK_DIRENTS(block) ((struct tfs_dirent *)BLOCK(block))
 // Cast block data to an array of block offsets.
-#define BLOCK_POINTERS(block) ((blkoff_t *)(tfs_info.data[block]))
+#define BLOCK_POINTERS(block) ((blkoff_t *)BLOCK(block))
 // Cast block data to the next member in the free block linked list.
 #define NEXT_FREE_BLOCK(block) BLOCK_POINTERS(block)[0]
 
+// Seconds after which relatime updates atime regardless of mtime.
+#define RELATIME_INTERVAL (24 * 60 * 60)
+
+/**
+ * Current time for timestamps.
+ *
+ * Tick resolution is plenty for file times and avoids a proper clock read.
+ */
+static void now(struct timespec *ts) {
+	clock_gettime(CLOCK_REALTIME_COARSE, ts);
+}
+
+/**
+ * Find where a block lives in the backing files.
+ */
+static inline char *block_data(blkoff_t block) {
+	// Common case, a single file.
+	if (tfs_info.nfiles == 1)
+		return tfs_info.data + (block << BLOCK_SIZE_NBITS);
+
+	struct tfs_segment *segment = tfs_info.segments;
+	while (block >= segment->first + segment->nblocks)
+		segment++;
+
+	// Stripes go round-robin over the files of the segment.
+	blkoff_t offset = block - segment->first;
+	blkoff_t stripe = offset >> tfs_info.stripe_nbits;
+	struct tfs_file *file = &tfs_info.files[segment->first_file + stripe % segment->nfiles];
+	blkoff_t local = (stripe / segment->nfiles) << tfs_info.stripe_nbits | (offset & ((1 << tfs_info.stripe_nbits) - 1));
+
+	return file->data + (local << BLOCK_SIZE_NBITS);
+}
+
 /**
  * Iterating through indirect levels is painful,
  * so the process is abstracted away with the help of this iterator-like thingy.
  */
 struct block_cursor {
 	struct tfs_node *node;
+	struct tfs_node_pointers *ptrs;
 	blkoff_t i;
 	int level;
 	blkoff_t pos[ILEVELS];
@@ -37,18 +86,19 @@ struct block_cursor {
 
 // Get what block an iterator is currently on.
 #define CURRENT_BLOCK(cursor)                                                                                          \
-	((cursor)->i < DIRECT_BLOCKS ? (cursor)->node->blocks[(cursor)->i]                                                 \
+	((cursor)->i < DIRECT_BLOCKS ? (cursor)->ptrs->blocks[(cursor)->i]                                                 \
 	                             : BLOCK_POINTERS((cursor)->block[(cursor)->level])[(cursor)->pos[(cursor)->level]])
 
 // Iterator definition helper
 #define DEFINE_BLOCK_CURSOR(var, nodeptr)                                                                              \
 	struct block_cursor var = {                                                                                        \
 	    .node = nodeptr,                                                                                               \
+	    .ptrs = NODE_POINTERS(nodeptr),                                                                                \
 	    .level = -1,                                                                                                   \
 	};
 
 // Most significant bit
-static int msb(unsigned int n) {
+static int msb(unsigned long n) {
 	// I'm pretty sure gcc -O>1 compiles this down to a single BSR instruction.
 	// Godbolt says it does, in which case this happens to be fast enough.
 	// In any case, this is faster than log2().
@@ -59,13 +109,10 @@ static int msb(unsigned int n) {
 	return r;
 }
 
-// msb(x) == floor(log2(x))
-#define MAX_POINTERS_NBITS msb(BLOCK_MAX_POINTERS)
-#define BLOCK_SIZE_NBITS msb(BLOCK_SIZE)
-// floor-log base MAX_POINTERS
+// floor-log base MAX_POINTERS, msb(x) == floor(log2(x))
 #define FLOG(x) (msb(x) / MAX_POINTERS_NBITS)
 // This bit-twiddling is why BLOCK_SIZE must be a power of 2.
-#define MAX_POINTERS_POW(e) (e == 0 ? 1 : BLOCK_MAX_POINTERS << (MAX_POINTERS_NBITS * (e - 1)))
+#define MAX_POINTERS_POW(e) ((blkoff_t)1 << (MAX_POINTERS_NBITS * (e)))
 
 /**
  * Set the position of a cursor for random access.
@@ -78,7 +125,7 @@ static blkoff_t block_seek(struct block_cursor *cursor, blkoff_t pos) {
 	if (pos > nblocks)
 		return -1;
 	if (pos < DIRECT_BLOCKS)
-		return cursor->node->blocks[pos];
+		return cursor->ptrs->blocks[pos];
 
 	// Start from 0
 	pos -= DIRECT_BLOCKS;
@@ -86,12 +133,12 @@ static blkoff_t block_seek(struct block_cursor *cursor, blkoff_t pos) {
 	blkoff_t accum = BLOCK_MAX_POINTERS * (MAX_POINTERS_POW(cursor->level) - 1) / (BLOCK_MAX_POINTERS - 1);
 	blkoff_t offset = pos - accum;
 
-	cursor->block[0] = cursor->node->iblocks[cursor->level];
+	cursor->block[0] = cursor->ptrs->iblocks[cursor->level];
 
 	for (int i = 0; i < cursor->level; i++) {
 		blkcnt_t N = MAX_POINTERS_POW(cursor->level - i);
-		cursor->pos[i] = offset / N;
-		offset %= N;
+		cursor->pos[i] = offset >> (MAX_POINTERS_NBITS * (cursor->level - i));
+		offset &= N - 1;
 		cursor->block[i + 1] = BLOCK_POINTERS((cursor)->block[i])[(cursor)->pos[i]];
 	}
 
@@ -134,9 +181,9 @@ static blkoff_t _next_block_callback(struct block_cursor *cursor, int level) {
 	if (cursor->i >= cursor->node->nblocks)
 		return END_BLOCKS;
 	if (cursor->i < DIRECT_BLOCKS)
-		return cursor->node->blocks[cursor->i];
+		return cursor->ptrs->blocks[cursor->i];
 	if (level == -1)
-		return cursor->node->iblocks[cursor->level];
+		return cursor->ptrs->iblocks[cursor->level];
 
 	return BLOCK_POINTERS((cursor)->block[level])[(cursor)->pos[level]];
 }
@@ -146,42 +193,155 @@ static blkoff_t _next_block_callback(struct block_cursor *cursor, int level) {
  */
 #define next_block(cursor) iter_through(cursor, _next_block_callback)
 
+/**
+ * Map a colon separated list of files after the ones already open.
+ */
+static int open_files(const char *filenames) {
+	char *list = strdup(filenames), *save = NULL;
+	int ret = 0;
+
+	for (char *filename = strtok_r(list, ":", &save); filename; filename = strtok_r(NULL, ":", &save)) {
+		if (tfs_info.nfiles == MAX_FILES) {
+			ret = -E2BIG;
+			break;
+		}
+
+		int rdonly = tfs_info.flags & TFS_RDONLY;
+		int fd = open(filename, rdonly ? O_RDONLY : O_RDWR);
+		if (fd == -1) {
+			ret = -errno;
+			break;
+		}
+
+		// Memory map the file.
+		// This will work for most x86-64 machines, but I'm not so sure about much else...
+		struct tfs_file *file = &tfs_info.files[tfs_info.nfiles];
+		file->size = lseek(fd, 0, SEEK_END);
+		file->base = mmap(NULL, file->size, rdonly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+
+		if (file->base == MAP_FAILED) {
+			ret = -errno;
+			break;
+		}
+
+		// Only the first file has metadata, blocks start right away in the rest.
+		file->data = file->base;
+		tfs_info.nfiles += 1;
+	}
+
+	free(list);
+
+	return ret;
+}
+
 int tfs_open(const char *filename) {
-	int fd = open(filename, O_RDWR);
-	if (fd == -1)
-		return -errno;
+	tfs_info.nfiles = 0;
 
-	// Memory map the file.
-	// This will work for most x86-64 machines, but I'm not so sure about much else...
-	tfs_info.filesize = lseek(fd, 0, SEEK_END);
-	tfs_info.base = mmap(NULL, tfs_info.filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	close(fd);
+	int ret = open_files(filename);
+	if (ret)
+		return ret;
+	if (!tfs_info.nfiles)
+		return -ENOENT;
 
-	if (tfs_info.base == MAP_FAILED)
-		return -errno;
+	tfs_info.base = tfs_info.files[0].base;
+	tfs_info.filesize = tfs_info.files[0].size;
 
 	return 0;
 }
 
-void tfs_format() {
+// Round up to a multiple of a power of 2.
+#define ALIGN(x, a) (((x) + (a)-1) & ~(off_t)((a)-1))
+// Size of a node across the node and pointer tables.
+#define NODE_RECORD_SIZE (sizeof(struct tfs_node) + sizeof(struct tfs_node_pointers))
+// Where the node table starts, cache line aligned.
+#define NODES_OFFSET ALIGN(sizeof(struct tfs_header), CACHE_LINE_SIZE)
+
+/**
+ * Where block data starts given the number of nodes.
+ *
+ * Kept page aligned so blocks never straddle more pages than they have to.
+ */
+static off_t data_offset(nodoff_t nnodes) {
+	return ALIGN(NODES_OFFSET + NODE_RECORD_SIZE * nnodes, MIN_BLOCK_SIZE);
+}
+
+/**
+ * Set up a segment striped across files `first_file` onwards, returning how many blocks it holds.
+ *
+ * Every file holds the same number of whole stripes, so what does not fit evenly is left unused.
+ */
+static blkoff_t add_segment(struct tfs_header *header, int first_file, blkoff_t first_block) {
+	struct tfs_segment *segment = &header->segments[header->nsegments++];
+	blkoff_t nblocks = -1;
+
+	for (int i = first_file; i < tfs_info.nfiles; i++) {
+		struct tfs_file *file = &tfs_info.files[i];
+		blkoff_t capacity = (file->size - (file->data - (char *)file->base)) >> header->block_nbits;
+		nblocks = nblocks == -1 ? capacity : MIN(nblocks, capacity);
+		header->filesizes[i] = file->size;
+	}
+
+	segment->first = first_block;
+	segment->first_file = first_file;
+	segment->nfiles = tfs_info.nfiles - first_file;
+	// A single file needs no whole stripes, its blocks simply follow each other.
+	if (segment->nfiles > 1)
+		nblocks = nblocks >> header->stripe_nbits << header->stripe_nbits;
+	segment->nblocks = MAX(nblocks, 0) * segment->nfiles;
+	header->nfiles = tfs_info.nfiles;
+
+	return segment->nblocks;
+}
+
+int tfs_format(size_t block_size, size_t stripe_size) {
 	struct tfs_header *header = tfs_info.base;
+	off_t total_size = 0;
+
+	if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)))
+		return -EINVAL;
+	if (stripe_size < block_size || (stripe_size & (stripe_size - 1)))
+		return -EINVAL;
+
+	for (int i = 0; i < tfs_info.nfiles; i++)
+		total_size += tfs_info.files[i].size;
+
 	// Allocate the FAT (implicitly), blocks, and nodes.
-	header->nblocks = tfs_info.filesize / (BLOCK_SIZE + (sizeof(struct tfs_node) / BLOCKS_PER_NODE));
-	header->nnodes = header->nblocks / BLOCKS_PER_NODE;
+	header->block_nbits = msb(block_size);
+	header->stripe_nbits = msb(stripe_size / block_size);
+	header->nnodes = total_size / (block_size + (NODE_RECORD_SIZE / BLOCKS_PER_NODE)) / BLOCKS_PER_NODE;
+	if (data_offset(header->nnodes) >= tfs_info.filesize)
+		return -ENOSPC;
+
+	// Blocks go after the node tables in the first file.
+	tfs_info.files[0].data = tfs_info.base + data_offset(header->nnodes);
+	header->nsegments = 0;
+	header->nblocks = add_segment(header, 0, 0);
+	if (header->nblocks == 0 || header->nnodes == 0)
+		return -ENOSPC;
+
 	// Root takes 1 node.
 	header->free_node_head = 1;
 	header->free_block_head = 0;
+	header->free_nodes = header->nnodes - 1;
+	header->free_blocks = header->nblocks;
+	header->generation = 1;
+	header->index_node = END_NODES;
+	header->refs_node = END_NODES;
 
 	// Now (re)calculate pointers to FAT n' stuff.
-	tfs_init();
+	int ret = tfs_init();
+	if (ret)
+		return ret;
 
 	// Initialize root node:
 	struct tfs_node *root = &tfs_info.nodes[0];
 	root->mode = S_IFDIR | 644;
-	root->name[0] = '\0'; // Root has no name.
+	root->flags = 0;
+	root->gen = header->generation;
 	root->nblocks = 0;
 	root->nlink = 0;
-	clock_gettime(CLOCK_REALTIME, &root->atim);
+	now(&root->atim);
 	root->mtim = root->atim;
 
 	// Initialize free blocks:
@@ -193,69 +353,233 @@ void tfs_format() {
 	for (int i = *tfs_info.free_node_head; i < tfs_info.nnodes - 1; i++)
 		tfs_info.nodes[i].next = i + 1;
 	tfs_info.nodes[tfs_info.nnodes - 1].next = END_NODES;
+
+	return 0;
+}
+
+static int resize_refs(struct tfs_node *refs);
+
+int tfs_grow(const char *filenames) {
+	struct tfs_header *header = tfs_info.base;
+	int first_file = tfs_info.nfiles;
+
+	if (header->nsegments == MAX_FILES)
+		return -E2BIG;
+
+	int ret = open_files(filenames);
+	if (ret)
+		return ret;
+
+	blkoff_t first = tfs_info.nblocks;
+	blkoff_t nblocks = add_segment(header, first_file, first);
+	if (!nblocks) {
+		header->nsegments -= 1;
+		header->nfiles = first_file;
+		return -ENOSPC;
+	}
+
+	header->nblocks += nblocks;
+	ret = tfs_init();
+	if (ret)
+		return ret;
+
+	// Put the new blocks in front of the free list, in order.
+	for (blkoff_t block = first; block < first + nblocks - 1; block++)
+		NEXT_FREE_BLOCK(block) = block + 1;
+	NEXT_FREE_BLOCK(first + nblocks - 1) = *tfs_info.free_block_head;
+	*tfs_info.free_block_head = first;
+	*tfs_info.free_blocks += nblocks;
+
+	// The new blocks need reference counts too.
+	if (*tfs_info.refs_node != END_NODES)
+		return resize_refs(&tfs_info.nodes[*tfs_info.refs_node]);
+
+	return 0;
 }
 
 /**
- * Walk the entire filesystem, adding all nodes to the hash table.
+ * Walk the entire filesystem, calling `fn` with the full path of every node.
+ *
+ * `fn` takes ownership of the path, which must outlive the walk.
  */
-static void init_htable(const char *path, struct tfs_node *node) {
-	ENTRY entry;
+static void walk_paths(const char *path, const char *name, struct tfs_node *node,
+                       void (*fn)(char *path, struct tfs_node *node, void *arg), void *arg) {
+	char *key;
 
 	if (path) {
-		entry.key = malloc(strlen(path) + 1 + strlen(node->name) + 1);
-		sprintf(entry.key, "%s/%s", path, node->name);
+		key = malloc(strlen(path) + 1 + strlen(name) + 1);
+		sprintf(key, "%s/%s", path, name);
 	} else {
 		// Special case for root
-		entry.key = strdup("/");
+		key = strdup("/");
 	}
 
-	entry.data = node;
-	hsearch(entry, ENTER);
-
-	fprintf(stderr, "found %s\n", entry.key);
+	fn(key, node, arg);
 
 	if (!(node->mode & S_IFDIR))
 		return;
 
 	// Recurse through directory:
-	struct tfs_node **children = tfs_node_children(node);
+	struct tfs_dirent *children = tfs_node_children(node);
 
 	for (int i = 0; i < node->nlink; i++)
-		init_htable(path ? entry.key : "", children[i]);
+		walk_paths(path ? key : "", children[i].name, &tfs_info.nodes[children[i].node], fn, arg);
 
 	free(children);
 }
 
-void tfs_init() {
+/**
+ * Add a node to the hash table.
+ */
+static void htable_enter(char *path, struct tfs_node *node, void *arg) {
+	ENTRY entry = {
+	    .key = path,
+	    .data = node,
+	};
+	hsearch(entry, ENTER);
+
+	fprintf(stderr, "found %s\n", path);
+}
+
+int tfs_init() {
 	struct tfs_header *header = tfs_info.base;
 
+	if (header->nfiles != tfs_info.nfiles)
+		return -EINVAL;
+	for (int i = 0; i < tfs_info.nfiles; i++)
+		if (tfs_info.files[i].size < header->filesizes[i])
+			return -EINVAL;
+
 	tfs_info.nblocks = header->nblocks;
 	tfs_info.nnodes = header->nnodes;
+	tfs_info.block_nbits = header->block_nbits;
+	tfs_info.block_size = (size_t)1 << tfs_info.block_nbits;
+	tfs_info.max_pointers = tfs_info.block_size / sizeof(blkoff_t);
+	tfs_info.max_pointers_nbits = msb(tfs_info.max_pointers);
+	tfs_info.max_children = tfs_info.block_size / sizeof(struct tfs_dirent);
+	tfs_info.stripe_nbits = header->stripe_nbits;
+	tfs_info.segments = header->segments;
 	tfs_info.free_block_head = &header->free_block_head;
 	tfs_info.free_node_head = &header->free_node_head;
-	tfs_info.nodes = tfs_info.base + sizeof(struct tfs_header);
-	tfs_info.data = (void *)tfs_info.nodes + sizeof(struct tfs_node) * tfs_info.nnodes;
-
+	tfs_info.free_blocks = &header->free_blocks;
+	tfs_info.free_nodes = &header->free_nodes;
+	tfs_info.generation = &header->generation;
+	tfs_info.index_node = &header->index_node;
+	tfs_info.refs_node = &header->refs_node;
+	tfs_info.nodes = tfs_info.base + NODES_OFFSET;
+	tfs_info.pointers = (void *)(tfs_info.nodes + tfs_info.nnodes);
+	tfs_info.data = tfs_info.base + data_offset(tfs_info.nnodes);
+	tfs_info.files[0].data = tfs_info.data;
+
+	fprintf(stderr, "block_size: %zu\n", tfs_info.block_size);
 	fprintf(stderr, "nblocks: %ld\n", tfs_info.nblocks);
 	fprintf(stderr, "nnodes: %ld\n", tfs_info.nnodes);
 	fprintf(stderr, "free_node_head: %ld\n", *tfs_info.free_node_head);
 	fprintf(stderr, "free_block_head: %ld\n", *tfs_info.free_block_head);
+	fprintf(stderr, "free_nodes: %ld\n", *tfs_info.free_nodes);
+	fprintf(stderr, "free_blocks: %ld\n", *tfs_info.free_blocks);
+	fprintf(stderr, "generation: %lu\n", *tfs_info.generation);
+	fprintf(stderr, "files: %d\n", tfs_info.nfiles);
+
+	return 0;
 }
 
-int tfs_load(const char *filename) {
+int tfs_load(const char *filename, int flags) {
+	// Read-only images don't get timestamps written either.
+	if (flags & TFS_RDONLY)
+		flags = (flags & ~(TFS_RELATIME | TFS_LAZYTIME)) | TFS_NOATIME;
+	// Needed by tfs_open() already.
+	tfs_info.flags = flags;
+
 	int ret = tfs_open(filename);
 	if (ret)
 		return ret;
 
-	tfs_init();
+	ret = tfs_init();
+	if (ret)
+		return ret;
+
+	if (flags & TFS_LAZYTIME) {
+		tfs_info.lazy = calloc(tfs_info.nnodes, sizeof(struct tfs_times));
+		if (!tfs_info.lazy)
+			return -ENOMEM;
+	}
+
+	if (flags & TFS_RDONLY && *tfs_info.index_node != END_NODES) {
+		// The index is in the image, so it is shared with every other mount through the page cache.
+		struct tfs_index_header header;
+		tfs_info.index = &tfs_info.nodes[*tfs_info.index_node];
+		tfs_node_read(tfs_info.index, (void *)&header, sizeof(header), 0);
+		tfs_info.index_nslots = header.nslots;
+		return 0;
+	}
 
 	hcreate(tfs_info.nnodes); // Initialize hash table, see hsearch(3)
-	init_htable(NULL, &tfs_info.nodes[0]);
+	walk_paths(NULL, NULL, &tfs_info.nodes[0], htable_enter, NULL);
 
 	return ret;
 }
 
+void tfs_statfs(struct statvfs *stbuf) {
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = tfs_info.nblocks;
+	stbuf->f_bfree = *tfs_info.free_blocks;
+	stbuf->f_bavail = *tfs_info.free_blocks;
+	stbuf->f_files = tfs_info.nnodes;
+	stbuf->f_ffree = *tfs_info.free_nodes;
+	stbuf->f_favail = *tfs_info.free_nodes;
+	stbuf->f_namemax = NAME_LIMIT - 1;
+	stbuf->f_flag = tfs_info.flags & TFS_RDONLY ? ST_RDONLY : 0;
+}
+
+/**
+ * FNV-1a, for hashing paths in the lookup index.
+ */
+static uint64_t hash_path(const char *path) {
+	uint64_t hash = 0xcbf29ce484222325;
+
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+// Where slot `i` is in the lookup index.
+#define INDEX_SLOT_OFFSET(i) (sizeof(struct tfs_index_header) + (i) * sizeof(struct tfs_index_slot))
+
+/**
+ * Look a path up in the lookup index.
+ */
+static struct tfs_node *index_lookup(const char *path) {
+	struct tfs_index_slot slot;
+	uint64_t hash = hash_path(path);
+	size_t len = strlen(path) + 1;
+	char found[PATH_MAX];
+
+	if (len > PATH_MAX)
+		return NULL;
+
+	for (uint64_t i = hash & (tfs_info.index_nslots - 1);; i = (i + 1) & (tfs_info.index_nslots - 1)) {
+		tfs_node_read(tfs_info.index, (void *)&slot, sizeof(slot), INDEX_SLOT_OFFSET(i));
+
+		if (slot.node == END_NODES)
+			return NULL;
+		if (slot.hash != hash)
+			continue;
+
+		tfs_node_read(tfs_info.index, found, len, slot.path);
+		if (!memcmp(found, path, len))
+			return &tfs_info.nodes[slot.node];
+	}
+}
+
 struct tfs_node *get_node(const char *path) {
+	if (tfs_info.index)
+		return index_lookup(path);
+
 	ENTRY entry = {
 	    .key = strdup(path),
 	};
@@ -297,6 +621,183 @@ static void set_node(const char *path, struct tfs_node *node) {
 	free(entry.key);
 }
 
+/**
+ * Tag a node as changed in the current generation.
+ */
+static void touch_gen(struct tfs_node *node) {
+	// Don't dirty the node if it already is tagged.
+	if (node->gen != *tfs_info.generation)
+		node->gen = *tfs_info.generation;
+}
+
+void tfs_flush_times() {
+	for (int i = 0; i < tfs_info.nlazy; i++) {
+		struct tfs_times *times = &tfs_info.lazy[tfs_info.lazy_dirty[i]];
+		struct tfs_node *node = &tfs_info.nodes[tfs_info.lazy_dirty[i]];
+
+		// Nodes can be dirtied again after being dropped, so skip duplicates.
+		if (!times->dirty)
+			continue;
+
+		// Writes and utimens tagged the node already, reads didn't.
+		if (times->atim.tv_sec != node->atim.tv_sec || times->atim.tv_nsec != node->atim.tv_nsec)
+			touch_gen(node);
+		node->atim = times->atim;
+		node->mtim = times->mtim;
+		times->dirty = 0;
+	}
+
+	tfs_info.nlazy = 0;
+}
+
+/**
+ * Get the lazytime entry of a node, starting one if needed.
+ */
+static struct tfs_times *lazy_times(struct tfs_node *node) {
+	struct tfs_times *times = &tfs_info.lazy[NODENO(node)];
+
+	if (times->dirty)
+		return times;
+
+	if (tfs_info.nlazy == LAZYTIME_BATCH)
+		tfs_flush_times();
+
+	times->atim = node->atim;
+	times->mtim = node->mtim;
+	times->dirty = 1;
+	tfs_info.lazy_dirty[tfs_info.nlazy++] = NODENO(node);
+
+	return times;
+}
+
+void tfs_node_times(struct tfs_node *node, struct timespec *atim, struct timespec *mtim) {
+	struct tfs_times *times = tfs_info.lazy ? &tfs_info.lazy[NODENO(node)] : NULL;
+
+	if (times && times->dirty) {
+		*atim = times->atim;
+		*mtim = times->mtim;
+	} else {
+		*atim = node->atim;
+		*mtim = node->mtim;
+	}
+}
+
+int tfs_node_utimens(struct tfs_node *node, const struct timespec tv[2]) {
+	if (tfs_info.flags & TFS_RDONLY || node->flags & TFS_NODE_IMMUTABLE)
+		return -EROFS;
+
+	touch_gen(node);
+
+	if (tfs_info.lazy) {
+		struct tfs_times *times = lazy_times(node);
+		times->atim = tv[0];
+		times->mtim = tv[1];
+	} else {
+		node->atim = tv[0];
+		node->mtim = tv[1];
+	}
+
+	return 0;
+}
+
+/**
+ * Update the access time of a node according to the atime mode.
+ */
+static void touch_atime(struct tfs_node *node) {
+	struct timespec ts, atim, mtim;
+
+	if (tfs_info.flags & TFS_NOATIME || node->flags & TFS_NODE_IMMUTABLE)
+		return;
+
+	now(&ts);
+
+	if (tfs_info.flags & TFS_RELATIME) {
+		tfs_node_times(node, &atim, &mtim);
+		// Only update if atime would otherwise say the file has not been read since it changed, or is stale.
+		if ((atim.tv_sec > mtim.tv_sec || (atim.tv_sec == mtim.tv_sec && atim.tv_nsec > mtim.tv_nsec)) &&
+		    ts.tv_sec - atim.tv_sec < RELATIME_INTERVAL)
+			return;
+	}
+
+	if (tfs_info.lazy) {
+		lazy_times(node)->atim = ts;
+	} else if (ts.tv_sec != node->atim.tv_sec || ts.tv_nsec != node->atim.tv_nsec) {
+		node->atim = ts;
+		// Incremental exports carry atimes too.
+		touch_gen(node);
+	}
+}
+
+/**
+ * Update the modification time of a node.
+ */
+static void touch_mtime(struct tfs_node *node) {
+	struct timespec ts;
+	now(&ts);
+
+	if (tfs_info.lazy)
+		lazy_times(node)->mtim = ts;
+	else
+		node->mtim = ts;
+}
+
+/**
+ * Reference count of a block, how many nodes share it besides the first.
+ *
+ * Only valid once the reference count node exists.
+ */
+static uint32_t *block_refs(blkoff_t block) {
+	struct tfs_node *refs = &tfs_info.nodes[*tfs_info.refs_node];
+	off_t offset = block * sizeof(uint32_t);
+	DEFINE_BLOCK_CURSOR(cursor, refs);
+
+	return (uint32_t *)(BLOCK(block_seek(&cursor, BLOCK_INDEX(offset))) + BLOCK_OFFSET(offset));
+}
+
+/**
+ * Drop one reference to a block of a shared node.
+ *
+ * Returns 1 if someone else still uses the block, 0 if it is ours alone.
+ */
+static int unref_block(struct tfs_node *node, blkoff_t block) {
+	if (!(node->flags & TFS_NODE_SHARED) || *tfs_info.refs_node == END_NODES)
+		return 0;
+
+	uint32_t *refs = block_refs(block);
+	if (!*refs)
+		return 0;
+
+	*refs -= 1;
+	touch_gen(&tfs_info.nodes[*tfs_info.refs_node]);
+
+	return 1;
+}
+
+/**
+ * Where the block a cursor sits on is pointed to from.
+ */
+static blkoff_t *cursor_slot(struct block_cursor *cursor) {
+	if (cursor->i < DIRECT_BLOCKS)
+		return &cursor->ptrs->blocks[cursor->i];
+
+	return &BLOCK_POINTERS(cursor->block[cursor->level])[cursor->pos[cursor->level]];
+}
+
+/**
+ * Take a block off the free list.
+ */
+static blkoff_t alloc_block() {
+	blkoff_t block = *tfs_info.free_block_head;
+
+	if (block == END_BLOCKS)
+		return END_BLOCKS;
+
+	*tfs_info.free_block_head = NEXT_FREE_BLOCK(block);
+	*tfs_info.free_blocks -= 1;
+
+	return block;
+}
+
 /**
  * Iterator callback for freeing blocks we iterate through.
  *
@@ -313,17 +814,15 @@ static blkoff_t _free_callback(struct block_cursor *cursor, int level) {
  * Also kind of hacky...
  */
 static blkoff_t _alloc_callback(struct block_cursor *cursor, int level) {
-	blkoff_t block = *tfs_info.free_block_head;
+	blkoff_t block = alloc_block();
 
 	if (block == END_BLOCKS)
 		return -1;
 
-	*tfs_info.free_block_head = NEXT_FREE_BLOCK(block);
-
 	if (cursor->i < DIRECT_BLOCKS)
-		return cursor->node->blocks[cursor->i] = block;
+		return cursor->ptrs->blocks[cursor->i] = block;
 	if (level == -1)
-		return cursor->node->iblocks[cursor->level] = block;
+		return cursor->ptrs->iblocks[cursor->level] = block;
 
 	return BLOCK_POINTERS((cursor)->block[level])[(cursor)->pos[level]] = block;
 }
@@ -332,9 +831,22 @@ int tfs_node_trim(struct tfs_node *node) {
 	blkoff_t nrblocks = NODE_NRBLOCKS(node);
 	blkoff_t dblocks = nrblocks - node->nblocks;
 
+	if (tfs_info.flags & TFS_RDONLY || node->flags & TFS_NODE_IMMUTABLE)
+		return -EROFS;
+
+	// Everything that changes a node comes through here.
+	touch_gen(node);
+
+	// Nothing to do, and don't dirty the node by storing the same values.
+	if (!dblocks)
+		return 0;
+
 	DEFINE_BLOCK_CURSOR(cursor, node);
 
 	if (dblocks < 0) {
+		// Whatever is left from last time is not ours to free.
+		for (int i = 0; i <= ILEVELS; i++)
+			free_block_buffer[i] = -1;
 		block_seek(&cursor, nrblocks - 1);
 		while (dblocks && iter_through(&cursor, _free_callback) != END_BLOCKS) {
 			dblocks += 1;
@@ -343,8 +855,14 @@ int tfs_node_trim(struct tfs_node *node) {
 			for (int i = 0; i <= cursor.level + 1; i++) {
 				if (free_block_buffer[i] < 0)
 					continue;
+				// Data blocks still used by a clone stay allocated.
+				if (i == cursor.level + 1 && unref_block(node, free_block_buffer[i])) {
+					free_block_buffer[i] = -1;
+					continue;
+				}
 				NEXT_FREE_BLOCK(free_block_buffer[i]) = *tfs_info.free_block_head;
 				*tfs_info.free_block_head = free_block_buffer[i];
+				*tfs_info.free_blocks += 1;
 				free_block_buffer[i] = -1;
 			}
 		}
@@ -368,97 +886,295 @@ int tfs_node_trim(struct tfs_node *node) {
 int tfs_node_read(struct tfs_node *node, char *buf, size_t size, off_t offset) {
 	DEFINE_BLOCK_CURSOR(cursor, node);
 	size_t chunk, to_read = size;
-	blkoff_t block = block_seek(&cursor, offset / BLOCK_SIZE);
+	blkoff_t block = block_seek(&cursor, BLOCK_INDEX(offset));
 
-	while (offset < NODE_SIZE(node) && (chunk = MIN(to_read, BLOCK_SIZE - (offset % BLOCK_SIZE)))) {
-		memcpy(buf, &tfs_info.data[block][offset % BLOCK_SIZE], MIN(chunk, NODE_SIZE(node) - offset));
+	while (offset < NODE_SIZE(node) && (chunk = MIN(to_read, BLOCK_SIZE - BLOCK_OFFSET(offset)))) {
+		memcpy(buf, BLOCK(block) + BLOCK_OFFSET(offset), MIN(chunk, NODE_SIZE(node) - offset));
 		block = next_block(&cursor);
 		to_read -= chunk;
 		offset += chunk;
 		buf += chunk;
 	}
 
-	clock_gettime(CLOCK_REALTIME, &node->atim);
+	touch_atime(node);
 
 	return size - to_read;
 }
 
+int tfs_node_truncate(struct tfs_node *node, off_t size) {
+	if (tfs_info.flags & TFS_RDONLY || node->flags & TFS_NODE_IMMUTABLE)
+		return -EROFS;
+
+	node->size = size;
+
+	return tfs_node_trim(node);
+}
+
+/**
+ * Give a node its own copy of the block a cursor sits on if it is shared.
+ */
+static blkoff_t unshare_block(struct block_cursor *cursor, blkoff_t block) {
+	if (!(cursor->node->flags & TFS_NODE_SHARED) || *tfs_info.refs_node == END_NODES || !*block_refs(block))
+		return block;
+
+	blkoff_t copy = alloc_block();
+	if (copy == END_BLOCKS)
+		return END_BLOCKS;
+
+	memcpy(BLOCK(copy), BLOCK(block), BLOCK_SIZE);
+	unref_block(cursor->node, block);
+
+	return *cursor_slot(cursor) = copy;
+}
+
 int tfs_node_write(struct tfs_node *node, const char *buf, size_t size, off_t offset) {
-	node->size = MAX(node->size, offset + size);
+	if (tfs_info.flags & TFS_RDONLY || node->flags & TFS_NODE_IMMUTABLE)
+		return -EROFS;
+
+	if (offset + size > node->size)
+		node->size = offset + size;
 	int ret = tfs_node_trim(node);
 
 	DEFINE_BLOCK_CURSOR(cursor, node);
 	size_t chunk, to_write = size;
-	blkoff_t block = block_seek(&cursor, offset / BLOCK_SIZE);
+	blkoff_t block = block_seek(&cursor, BLOCK_INDEX(offset));
 
-	while (offset < NODE_SIZE(node) && (chunk = MIN(to_write, BLOCK_SIZE - (offset % BLOCK_SIZE)))) {
-		memcpy(&tfs_info.data[block][offset % BLOCK_SIZE], buf, chunk);
+	while (offset < NODE_SIZE(node) && (chunk = MIN(to_write, BLOCK_SIZE - BLOCK_OFFSET(offset)))) {
+		if ((block = unshare_block(&cursor, block)) == END_BLOCKS) {
+			ret = -ENOSPC;
+			break;
+		}
+		memcpy(BLOCK(block) + BLOCK_OFFSET(offset), buf, chunk);
 		block = next_block(&cursor);
 		to_write -= chunk;
 		offset += chunk;
 		buf += chunk;
 	}
 
-	clock_gettime(CLOCK_REALTIME, &node->mtim);
+	touch_mtime(node);
 
 	return ret < 0 ? ret : size - to_write;
 }
 
-struct tfs_node **tfs_node_children(struct tfs_node *node) {
-	nodoff_t *children = malloc(NODE_SIZE(node));
-	if (!children)
-		return NULL;
-
-	tfs_node_read(node, (void *)children, NODE_SIZE(node), 0);
+char *tfs_node_map(struct tfs_node *node, blkoff_t i, blkoff_t max, blkoff_t *count) {
+	DEFINE_BLOCK_CURSOR(cursor, node);
 
-	struct tfs_node **children_nodes = malloc(node->nlink * sizeof(struct tfs_node *));
-	if (!children_nodes)
+	*count = 0;
+	if (i >= node->nblocks)
 		return NULL;
 
-	for (int i = 0; i < node->nlink; i++)
-		children_nodes[i] = &tfs_info.nodes[children[i]];
+	char *first = BLOCK(block_seek(&cursor, i));
+	blkoff_t next;
+	*count = 1;
+	// Consecutive blocks may still be in different files when striping.
+	while (*count < max && (next = next_block(&cursor)) != END_BLOCKS && BLOCK(next) == first + *count * BLOCK_SIZE)
+		*count += 1;
 
-	free(children);
+	return first;
+}
 
-	return children_nodes;
+size_t tfs_block_size() {
+	return BLOCK_SIZE;
 }
 
-int tfs_add_node(const char *path, mode_t mode) {
-	if (get_node(path))
-		return -EEXIST;
-	if (*tfs_info.free_node_head == END_NODES)
-		return -ENOSPC;
+struct tfs_dirent *tfs_node_children(struct tfs_node *node) {
+	struct tfs_dirent *children = malloc(NODE_SIZE(node));
+	if (!children)
+		return NULL;
 
-	char *basename = strrchr(path, '/') + 1;
-	if (strlen(basename) + 1 > NAME_LIMIT)
-		return -ENAMETOOLONG;
+	tfs_node_read(node, (void *)children, NODE_SIZE(node), 0);
 
-	// Allocate node.
+	return children;
+}
+
+/**
+ * Take a node off the free list and initialize it.
+ */
+static struct tfs_node *alloc_node(mode_t mode) {
 	nodoff_t nodei = *tfs_info.free_node_head;
+	if (nodei == END_NODES)
+		return NULL;
+
 	struct tfs_node *node = &tfs_info.nodes[nodei];
 	*tfs_info.free_node_head = node->next;
+	*tfs_info.free_nodes -= 1;
 	fprintf(stderr, "\tAllocated node %ld...\n", nodei);
 
 	// Initialize node.
-	strcpy(node->name, basename);
 	node->mode = mode;
+	node->flags = 0;
 	if (node->mode & S_IFDIR)
 		node->nlink = 0;
 	else
 		node->size = 0;
 	node->nblocks = 0;
-	clock_gettime(CLOCK_REALTIME, &node->atim);
+	now(&node->atim);
 	node->mtim = node->atim;
+	touch_gen(node);
+	// Drop stale lazytime timestamps of whatever used this node before.
+	if (tfs_info.lazy)
+		tfs_info.lazy[nodei].dirty = 0;
+
+	return node;
+}
+
+/**
+ * Deallocate a node and its blocks.
+ */
+static void free_node(struct tfs_node *node) {
+	// Deallocate blocks, snapshots included once we get here.
+	node->flags &= ~TFS_NODE_IMMUTABLE;
+	node->size = 0;
+	tfs_node_trim(node);
+
+	// Deallocate node.
+	node->next = *tfs_info.free_node_head;
+	*tfs_info.free_node_head = NODENO(node);
+	*tfs_info.free_nodes += 1;
+}
+
+/**
+ * Drop the lookup index, it is out of date once paths change.
+ */
+static void drop_index() {
+	if (*tfs_info.index_node == END_NODES)
+		return;
+
+	free_node(&tfs_info.nodes[*tfs_info.index_node]);
+	*tfs_info.index_node = END_NODES;
+}
+
+/**
+ * Collect paths for the lookup index.
+ */
+struct index_paths {
+	char **paths;
+	nodoff_t *nodes;
+	size_t n, cap, strings_size;
+};
+
+static void index_collect(char *path, struct tfs_node *node, void *arg) {
+	struct index_paths *paths = arg;
+
+	if (paths->n == paths->cap) {
+		paths->cap = paths->cap ? paths->cap * 2 : 1024;
+		paths->paths = realloc(paths->paths, paths->cap * sizeof(char *));
+		paths->nodes = realloc(paths->nodes, paths->cap * sizeof(nodoff_t));
+	}
+
+	paths->paths[paths->n] = path;
+	paths->nodes[paths->n] = NODENO(node);
+	paths->strings_size += strlen(path) + 1;
+	paths->n += 1;
+}
+
+int tfs_build_index() {
+	struct index_paths paths = {0};
+	struct tfs_index_header header = {.nslots = 2};
+	int ret = 0;
+
+	drop_index();
+
+	// Walking directories must not change anything.
+	int flags = tfs_info.flags;
+	tfs_info.flags |= TFS_NOATIME;
+	walk_paths(NULL, NULL, &tfs_info.nodes[0], index_collect, &paths);
+	tfs_info.flags = flags;
+
+	// At most half full, so probe sequences stay short.
+	while (header.nslots < 2 * paths.n)
+		header.nslots *= 2;
+
+	size_t size = INDEX_SLOT_OFFSET(header.nslots) + paths.strings_size;
+	char *index = malloc(size);
+	if (!index) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	memcpy(index, &header, sizeof(header));
+	struct tfs_index_slot *slots = (void *)(index + INDEX_SLOT_OFFSET(0));
+	for (uint64_t i = 0; i < header.nslots; i++)
+		slots[i].node = END_NODES;
+
+	uint64_t string = INDEX_SLOT_OFFSET(header.nslots);
+	for (size_t i = 0; i < paths.n; i++) {
+		uint64_t hash = hash_path(paths.paths[i]);
+		uint64_t slot = hash & (header.nslots - 1);
+
+		while (slots[slot].node != END_NODES)
+			slot = (slot + 1) & (header.nslots - 1);
+
+		slots[slot] = (struct tfs_index_slot){.hash = hash, .node = paths.nodes[i], .path = string};
+		strcpy(index + string, paths.paths[i]);
+		string += strlen(paths.paths[i]) + 1;
+	}
+
+	// Stored as a node that is in no directory.
+	struct tfs_node *node = alloc_node(S_IFREG | 0444);
+	if (!node) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	ret = tfs_node_write(node, index, size, 0);
+	if (ret < 0) {
+		free_node(node);
+		goto out;
+	}
+
+	*tfs_info.index_node = NODENO(node);
+	ret = 0;
+
+out:
+	for (size_t i = 0; i < paths.n; i++)
+		free(paths.paths[i]);
+	free(paths.paths);
+	free(paths.nodes);
+	free(index);
+
+	return ret;
+}
+
+int tfs_add_node(const char *path, mode_t mode) {
+	if (tfs_info.flags & TFS_RDONLY)
+		return -EROFS;
+	// Absolute paths naming something only.
+	if (path[0] != '/' || path[strlen(path) - 1] == '/')
+		return -EINVAL;
+	if (get_node(path))
+		return -EEXIST;
+	if (*tfs_info.free_node_head == END_NODES)
+		return -ENOSPC;
+
+	char *basename = strrchr(path, '/') + 1;
+	if (strlen(basename) + 1 > NAME_LIMIT)
+		return -ENAMETOOLONG;
 
-	// Add child to parent.
 	struct tfs_node *parent_node = get_directory(path);
+	if (!parent_node)
+		return -ENOENT;
+	if (!(parent_node->mode & S_IFDIR))
+		return -ENOTDIR;
+	if (parent_node->flags & TFS_NODE_IMMUTABLE)
+		return -EROFS;
+
+	drop_index();
+
+	// Allocate node.
+	struct tfs_node *node = alloc_node(mode);
+	nodoff_t nodei = NODENO(node);
+
+	// Add child to parent.
 	parent_node->nlink += 1;
 	tfs_node_trim(parent_node);
 	DEFINE_BLOCK_CURSOR(cursor, parent_node);
-	BLOCK_NODES(block_seek(&cursor, parent_node->nblocks - 1))
-	[(parent_node->nlink - 1) % BLOCK_MAX_CHILDREN] = nodei;
+	struct tfs_dirent *dirent =
+	    &BLOCK_DIRENTS(block_seek(&cursor, parent_node->nblocks - 1))[(parent_node->nlink - 1) % BLOCK_MAX_CHILDREN];
+	dirent->node = nodei;
+	strcpy(dirent->name, basename);
 
-	clock_gettime(CLOCK_REALTIME, &parent_node->mtim);
+	touch_mtime(parent_node);
 
 	// Update hash table.
 	set_node(path, node);
@@ -470,19 +1186,27 @@ int tfs_remove_node(const char *path) {
 	struct tfs_node *node = get_node(path);
 	struct tfs_node *parent_node = get_directory(path);
 
+	if (tfs_info.flags & TFS_RDONLY)
+		return -EROFS;
 	// Don't rm -rf / -_-
 	if (!parent_node)
 		return -ENOTSUP;
+	// Snapshots go with tfs_snapshot_delete().
+	if (node->flags & TFS_NODE_IMMUTABLE || parent_node->flags & TFS_NODE_IMMUTABLE)
+		return -EROFS;
+
+	drop_index();
 
 	// Remove from parent.
 	DEFINE_BLOCK_CURSOR(cursor, parent_node);
-	nodoff_t last_child =
-	    BLOCK_NODES(block_seek(&cursor, parent_node->nblocks - 1))[(parent_node->nlink - 1) % BLOCK_MAX_CHILDREN];
+	struct tfs_dirent *last_child =
+	    &BLOCK_DIRENTS(block_seek(&cursor, parent_node->nblocks - 1))[(parent_node->nlink - 1) % BLOCK_MAX_CHILDREN];
 
 	for (blkoff_t block = block_seek(&cursor, 0); block != END_BLOCKS; block = next_block(&cursor)) {
 		for (int i = 0; i < BLOCK_MAX_CHILDREN; i++) {
-			if (BLOCK_NODES(block)[i] == NODENO(node)) {
-				BLOCK_NODES(block)[i] = last_child;
+			if (BLOCK_DIRENTS(block)[i].node == NODENO(node)) {
+				if (&BLOCK_DIRENTS(block)[i] != last_child)
+					BLOCK_DIRENTS(block)[i] = *last_child;
 				goto outer;
 			}
 		}
@@ -490,15 +1214,9 @@ int tfs_remove_node(const char *path) {
 outer:
 	parent_node->nlink -= 1;
 	tfs_node_trim(parent_node);
-	clock_gettime(CLOCK_REALTIME, &parent_node->mtim);
+	touch_mtime(parent_node);
 
-	// Deallocate blocks.
-	node->size = 0;
-	tfs_node_trim(node);
-
-	// Deallocate node.
-	node->next = *tfs_info.free_node_head;
-	*tfs_info.free_node_head = NODENO(node);
+	free_node(node);
 
 	// Remove from hash table.
 	set_node(path, NULL);
@@ -506,7 +1224,548 @@ outer:
 	return 0;
 }
 
+/**
+ * Size the reference count node to cover every block, new blocks start out unshared.
+ */
+static int resize_refs(struct tfs_node *refs) {
+	off_t old_size = refs->size, size = tfs_info.nblocks * sizeof(uint32_t);
+	int ret = tfs_node_truncate(refs, size);
+	if (ret)
+		return ret;
+
+	char *zeros = calloc(1, BLOCK_SIZE);
+	for (off_t offset = old_size; offset < size; offset += BLOCK_SIZE)
+		tfs_node_write(refs, zeros, MIN(BLOCK_SIZE, size - offset), offset);
+	free(zeros);
+
+	return 0;
+}
+
+/**
+ * Create the reference count node, if there isn't one yet.
+ */
+static int make_refs() {
+	if (*tfs_info.refs_node != END_NODES)
+		return 0;
+
+	struct tfs_node *refs = alloc_node(S_IFREG | 0400);
+	if (!refs)
+		return -ENOSPC;
+
+	int ret = resize_refs(refs);
+	if (ret) {
+		free_node(refs);
+		return ret;
+	}
+	*tfs_info.refs_node = NODENO(refs);
+
+	return 0;
+}
+
+/**
+ * Number of pointer blocks a node with `nblocks` data blocks has.
+ */
+static blkoff_t pointer_blocks(blkoff_t nblocks) {
+	blkoff_t count = 0, capacity = 1;
+
+	nblocks -= DIRECT_BLOCKS;
+	for (int level = 0; level < ILEVELS && nblocks > 0; level++) {
+		capacity *= BLOCK_MAX_POINTERS;
+		blkoff_t n = MIN(nblocks, capacity);
+		// Each pointer block on the way down covers `covers` data blocks.
+		for (blkoff_t covers = capacity; covers > 1; covers /= BLOCK_MAX_POINTERS)
+			count += (n + covers - 1) / covers;
+		nblocks -= n;
+	}
+
+	return count;
+}
+
+/**
+ * Iterator callback for cloning: pointer blocks are allocated, data blocks are shared with the source.
+ */
+static struct block_cursor *clone_source;
+static blkoff_t _clone_callback(struct block_cursor *cursor, int level) {
+	// Don't write through a pointer block we failed to allocate.
+	if (cursor->i >= DIRECT_BLOCKS && level >= 0 && cursor->block[level] == -1)
+		return -1;
+	if (cursor->i >= DIRECT_BLOCKS && level < cursor->level)
+		return _alloc_callback(cursor, level);
+
+	blkoff_t block = next_block(clone_source);
+	*block_refs(block) += 1;
+
+	return *cursor_slot(cursor) = block;
+}
+
+int tfs_clone(const char *src_path, const char *dst_path) {
+	struct tfs_node *src = get_node(src_path);
+
+	if (tfs_info.flags & TFS_RDONLY)
+		return -EROFS;
+	if (!src)
+		return -ENOENT;
+	if (src->mode & S_IFDIR)
+		return -EISDIR;
+
+	int ret = make_refs();
+	if (ret)
+		return ret;
+	ret = tfs_add_node(dst_path, src->mode);
+	if (ret)
+		return ret;
+
+	// Make sure all pointer blocks fit before sharing anything.
+	if (*tfs_info.free_blocks < pointer_blocks(src->nblocks)) {
+		tfs_remove_node(dst_path);
+		return -ENOSPC;
+	}
+
+	struct tfs_node *dst = get_node(dst_path);
+	DEFINE_BLOCK_CURSOR(src_cursor, src);
+	DEFINE_BLOCK_CURSOR(dst_cursor, dst);
+	// Start both cursors right before the first block.
+	src_cursor.i = dst_cursor.i = -1;
+	clone_source = &src_cursor;
+
+	// Flag both first, so bailing out half way frees the shared blocks properly.
+	src->flags |= TFS_NODE_SHARED;
+	dst->flags |= TFS_NODE_SHARED;
+	touch_gen(src);
+	touch_gen(&tfs_info.nodes[*tfs_info.refs_node]);
+
+	while (dst->nblocks < src->nblocks) {
+		if (iter_through(&dst_cursor, _clone_callback) == -1) {
+			tfs_remove_node(dst_path);
+			return -ENOSPC;
+		}
+		dst->nblocks += 1;
+	}
+	dst->size = src->size;
+
+	return 0;
+}
+
+/**
+ * Give a snapshot node the times of the original and make it immutable.
+ */
+static int seal_node(struct tfs_node *src, struct tfs_node *dst) {
+	struct timespec tv[2];
+	tfs_node_times(src, &tv[0], &tv[1]);
+	int ret = tfs_node_utimens(dst, tv);
+	dst->flags |= TFS_NODE_IMMUTABLE;
+
+	return ret;
+}
+
+/**
+ * Clone a tree into a snapshot, sealing every node once it is complete.
+ */
+static int snapshot_tree(const char *src_path, const char *dst_path) {
+	struct tfs_node *src = get_node(src_path);
+
+	if (!(src->mode & S_IFDIR)) {
+		int ret = tfs_clone(src_path, dst_path);
+		return ret ? ret : seal_node(src, get_node(dst_path));
+	}
+
+	int ret = tfs_add_node(dst_path, src->mode);
+	if (ret)
+		return ret;
+
+	// Root paths end in a slash already.
+	const char *sep = strcmp(src_path, "/") ? "/" : "";
+	struct tfs_dirent *children = tfs_node_children(src);
+	nlink_t nlink = src->nlink;
+
+	for (nlink_t i = 0; i < nlink && !ret; i++) {
+		// Don't snapshot the snapshots.
+		if (!*sep && !strcmp(children[i].name, SNAPSHOT_DIR + 1))
+			continue;
+
+		char *child_src = malloc(strlen(src_path) + 1 + strlen(children[i].name) + 1);
+		char *child_dst = malloc(strlen(dst_path) + 1 + strlen(children[i].name) + 1);
+		sprintf(child_src, "%s%s%s", src_path, sep, children[i].name);
+		sprintf(child_dst, "%s/%s", dst_path, children[i].name);
+		ret = snapshot_tree(child_src, child_dst);
+		free(child_src);
+		free(child_dst);
+	}
+	free(children);
+
+	return ret ? ret : seal_node(src, get_node(dst_path));
+}
+
+/**
+ * Path of a snapshot, NULL if the name is no good.
+ */
+static char *snapshot_path(const char *name) {
+	if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, ".."))
+		return NULL;
+
+	char *path = malloc(sizeof(SNAPSHOT_DIR) + 1 + strlen(name));
+	sprintf(path, "%s/%s", SNAPSHOT_DIR, name);
+
+	return path;
+}
+
+/**
+ * Remove a tree, snapshots included.
+ */
+static void remove_tree(const char *path) {
+	struct tfs_node *node = get_node(path);
+	node->flags &= ~TFS_NODE_IMMUTABLE;
+
+	if (node->mode & S_IFDIR) {
+		struct tfs_dirent *children = tfs_node_children(node);
+		nlink_t nlink = node->nlink;
+
+		for (nlink_t i = 0; i < nlink; i++) {
+			char *child = malloc(strlen(path) + 1 + strlen(children[i].name) + 1);
+			sprintf(child, "%s/%s", path, children[i].name);
+			remove_tree(child);
+			free(child);
+		}
+		free(children);
+	}
+
+	tfs_remove_node(path);
+}
+
+int tfs_snapshot(const char *name) {
+	if (tfs_info.flags & TFS_RDONLY)
+		return -EROFS;
+
+	char *path = snapshot_path(name);
+	if (!path)
+		return -EINVAL;
+	if (strlen(name) + 1 > NAME_LIMIT) {
+		free(path);
+		return -ENAMETOOLONG;
+	}
+
+	int ret = 0;
+	struct tfs_node *snapshots = get_node(SNAPSHOT_DIR);
+	if (!snapshots)
+		ret = tfs_add_node(SNAPSHOT_DIR, S_IFDIR | 0755);
+	else if (!(snapshots->mode & S_IFDIR))
+		ret = -ENOTDIR;
+	if (!ret && get_node(path))
+		ret = -EEXIST;
+	if (!ret) {
+		ret = snapshot_tree("/", path);
+		// Don't leave half a snapshot around.
+		if (ret && get_node(path))
+			remove_tree(path);
+	}
+	free(path);
+
+	return ret;
+}
+
+int tfs_snapshot_delete(const char *name) {
+	if (tfs_info.flags & TFS_RDONLY)
+		return -EROFS;
+
+	char *path = snapshot_path(name);
+	if (!path)
+		return -EINVAL;
+
+	int ret = get_node(path) ? 0 : -ENOENT;
+	if (!ret)
+		remove_tree(path);
+	free(path);
+
+	return ret;
+}
+
+/**
+ * Call `fn` on every block of a node, pointer blocks included.
+ *
+ * Pointer blocks are visited right before the first block they point to.
+ */
+static void (*visit_block_fn)(blkoff_t block, void *arg);
+static void *visit_block_arg;
+static blkoff_t _visit_callback(struct block_cursor *cursor, int level) {
+	blkoff_t block = _next_block_callback(cursor, level);
+	visit_block_fn(block, visit_block_arg);
+	return block;
+}
+
+static void for_each_block(struct tfs_node *node, void (*fn)(blkoff_t block, void *arg), void *arg) {
+	DEFINE_BLOCK_CURSOR(cursor, node);
+	cursor.i = -1;
+	visit_block_fn = fn;
+	visit_block_arg = arg;
+
+	for (blkoff_t i = 0; i < node->nblocks; i++)
+		iter_through(&cursor, _visit_callback);
+}
+
+/**
+ * Call `fn` on every node reachable from the root, parents before their children.
+ */
+static void for_each_node(struct tfs_node *node, void (*fn)(struct tfs_node *node, void *arg), void *arg) {
+	fn(node, arg);
+
+	if (!(node->mode & S_IFDIR))
+		return;
+
+	struct tfs_dirent *children = tfs_node_children(node);
+	for (int i = 0; i < node->nlink; i++)
+		for_each_node(&tfs_info.nodes[children[i].node], fn, arg);
+	free(children);
+}
+
+/**
+ * Call `fn` on every node in use, including hidden ones in no directory.
+ */
+static void for_each_live_node(void (*fn)(struct tfs_node *node, void *arg), void *arg) {
+	for_each_node(&tfs_info.nodes[0], fn, arg);
+
+	if (*tfs_info.index_node != END_NODES)
+		fn(&tfs_info.nodes[*tfs_info.index_node], arg);
+	if (*tfs_info.refs_node != END_NODES)
+		fn(&tfs_info.nodes[*tfs_info.refs_node], arg);
+}
+
+struct export_state {
+	FILE *out;
+	int incremental;
+	uint64_t since;
+	// Blocks already written, clones share theirs.
+	unsigned char *sent;
+};
+
+static void export_block(blkoff_t block, void *arg) {
+	struct export_state *state = arg;
+	struct tfs_export_record record = {.type = EXPORT_BLOCK, .index = block};
+
+	if (state->sent[block / 8] & (1 << (block % 8)))
+		return;
+	state->sent[block / 8] |= 1 << (block % 8);
+
+	fwrite(&record, sizeof(record), 1, state->out);
+	fwrite(BLOCK(block), BLOCK_SIZE, 1, state->out);
+}
+
+static void export_node(struct tfs_node *node, void *arg) {
+	struct export_state *state = arg;
+	struct tfs_export_record record = {.type = EXPORT_NODE, .index = NODENO(node)};
+
+	fwrite(&record, sizeof(record), 1, state->out);
+	fwrite(node, sizeof(struct tfs_node), 1, state->out);
+	fwrite(NODE_POINTERS(node), sizeof(struct tfs_node_pointers), 1, state->out);
+}
+
+static void export_blocks(struct tfs_node *node, void *arg) {
+	struct export_state *state = arg;
+
+	if (!state->incremental || node->gen > state->since)
+		for_each_block(node, export_block, state);
+}
+
+int tfs_export(FILE *out, int incremental, uint64_t since, uint64_t *generation) {
+	struct export_state state = {.out = out, .incremental = incremental, .since = since};
+	struct tfs_export_header header = {
+	    .magic = EXPORT_MAGIC,
+	    .version = EXPORT_VERSION,
+	    .incremental = incremental,
+	    .since = since,
+	    .filesize = tfs_info.filesize,
+	};
+	struct tfs_export_record record = {.type = EXPORT_END};
+
+	state.sent = calloc((tfs_info.nblocks + 7) / 8, 1);
+	if (!state.sent)
+		return -ENOMEM;
+
+	// Walking directories must not change anything.
+	tfs_info.flags |= TFS_NOATIME;
+
+	fwrite(&header, sizeof(header), 1, out);
+	fwrite(tfs_info.base, sizeof(struct tfs_header), 1, out);
+
+	// Changed nodes, including freed ones so they get freed on restore too.
+	if (incremental) {
+		for (nodoff_t i = 0; i < tfs_info.nnodes; i++)
+			if (tfs_info.nodes[i].gen > since)
+				export_node(&tfs_info.nodes[i], &state);
+	} else {
+		for_each_live_node(export_node, &state);
+	}
+
+	// Blocks of changed nodes that are still in use.
+	for_each_live_node(export_blocks, &state);
+	free(state.sent);
+
+	fwrite(&record, sizeof(record), 1, out);
+
+	if (fflush(out) || ferror(out))
+		return -EIO;
+
+	// Anything changed from now on belongs to the next export.
+	*generation = (*tfs_info.generation)++;
+
+	return 0;
+}
+
+static void mark_node(struct tfs_node *node, void *arg) {
+	unsigned char *used = arg;
+	nodoff_t nodei = NODENO(node);
+	used[nodei / 8] |= 1 << (nodei % 8);
+}
+
+/**
+ * Rebuild the free node list from what is reachable from the root.
+ */
+static int rebuild_free_nodes() {
+	unsigned char *used = calloc((tfs_info.nnodes + 7) / 8, 1);
+	if (!used)
+		return -ENOMEM;
+
+	for_each_live_node(mark_node, used);
+
+	*tfs_info.free_node_head = END_NODES;
+	*tfs_info.free_nodes = 0;
+
+	// Backwards, so the list comes out in ascending order.
+	for (nodoff_t nodei = tfs_info.nnodes - 1; nodei >= 0; nodei--) {
+		if (used[nodei / 8] & (1 << (nodei % 8)))
+			continue;
+		tfs_info.nodes[nodei].next = *tfs_info.free_node_head;
+		*tfs_info.free_node_head = nodei;
+		*tfs_info.free_nodes += 1;
+	}
+
+	free(used);
+
+	return 0;
+}
+
+static void mark_block(blkoff_t block, void *arg) {
+	unsigned char *used = arg;
+	used[block / 8] |= 1 << (block % 8);
+}
+
+static void mark_blocks(struct tfs_node *node, void *arg) {
+	for_each_block(node, mark_block, arg);
+}
+
+/**
+ * Rebuild the free block list from what is reachable from the root.
+ */
+static int rebuild_free_blocks() {
+	unsigned char *used = calloc((tfs_info.nblocks + 7) / 8, 1);
+	if (!used)
+		return -ENOMEM;
+
+	for_each_live_node(mark_blocks, used);
+
+	*tfs_info.free_block_head = END_BLOCKS;
+	*tfs_info.free_blocks = 0;
+
+	// Backwards, so the list comes out in ascending order.
+	for (blkoff_t block = tfs_info.nblocks - 1; block >= 0; block--) {
+		if (used[block / 8] & (1 << (block % 8)))
+			continue;
+		NEXT_FREE_BLOCK(block) = *tfs_info.free_block_head;
+		*tfs_info.free_block_head = block;
+		*tfs_info.free_blocks += 1;
+	}
+
+	free(used);
+
+	return 0;
+}
+
+int tfs_restore(FILE *in, const char *filename) {
+	struct tfs_export_header header;
+	struct tfs_header superblock;
+	struct tfs_export_record record;
+
+	if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, EXPORT_MAGIC, sizeof(header.magic)) ||
+	    header.version != EXPORT_VERSION || fread(&superblock, sizeof(superblock), 1, in) != 1)
+		return -EINVAL;
+
+	if (!header.incremental) {
+		// Recreate the backing files at their original sizes.
+		char *list = strdup(filename), *save = NULL;
+		int i = 0, ret = 0;
+
+		for (char *name = strtok_r(list, ":", &save); name && !ret; name = strtok_r(NULL, ":", &save), i++) {
+			int fd = open(name, O_RDWR | O_CREAT, 0644);
+			if (fd == -1 || i >= superblock.nfiles || ftruncate(fd, superblock.filesizes[i]))
+				ret = i >= superblock.nfiles ? -EINVAL : -errno;
+			if (fd != -1)
+				close(fd);
+		}
+
+		free(list);
+		if (ret)
+			return ret;
+	}
+
+	int ret = tfs_open(filename);
+	if (ret)
+		return ret;
+
+	if (header.incremental) {
+		ret = tfs_init();
+		if (ret)
+			goto out;
+		// Only applies on top of exactly the export it was taken since.
+		if (*tfs_info.generation != header.since) {
+			ret = -ESTALE;
+			goto out;
+		}
+	}
+
+	memcpy(tfs_info.base, &superblock, sizeof(superblock));
+	ret = tfs_init();
+	if (ret)
+		goto out;
+	tfs_info.flags |= TFS_NOATIME;
+
+	while (fread(&record, sizeof(record), 1, in) == 1 && record.type != EXPORT_END) {
+		size_t n = 0;
+
+		if (record.type == EXPORT_NODE && record.index >= 0 && record.index < tfs_info.nnodes)
+			n = fread(&tfs_info.nodes[record.index], sizeof(struct tfs_node), 1, in) +
+			    fread(&tfs_info.pointers[record.index], sizeof(struct tfs_node_pointers), 1, in);
+		else if (record.type == EXPORT_BLOCK && record.index >= 0 && record.index < tfs_info.nblocks)
+			n = 2 * fread(BLOCK(record.index), BLOCK_SIZE, 1, in);
+
+		if (n != 2) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (record.type != EXPORT_END) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = rebuild_free_nodes();
+	if (!ret)
+		ret = rebuild_free_blocks();
+
+out:
+	tfs_destroy();
+	return ret;
+}
+
 int tfs_destroy() {
+	tfs_flush_times();
+	free(tfs_info.lazy);
+
 	// Write back changes to disk.
-	return munmap(tfs_info.base, tfs_info.filesize);
+	int ret = 0;
+	for (int i = 0; i < tfs_info.nfiles; i++)
+		if (munmap(tfs_info.files[i].base, tfs_info.files[i].size))
+			ret = -errno;
+	tfs_info.nfiles = 0;
+
+	return ret;
 }
@@ -1,52 +1,106 @@
 #ifndef TFS_H
 #define TFS_H
 
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <time.h>
 
 typedef off_t blkoff_t;
 typedef off_t nodoff_t;
 
-// Block size must be a power of 2 for bit twiddlings
-#define BLOCK_SIZE 4096
+// Block size is chosen at format time and must be a power of 2 for bit twiddlings
+#define DEFAULT_BLOCK_SIZE 4096
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (1 << 20)
 #define BLOCKS_PER_NODE 4
 #define DIRECT_BLOCKS 12
 #define ILEVELS 3
-#define NAME_LIMIT 64
-#define BLOCK_MAX_CHILDREN (BLOCK_SIZE / sizeof(nodoff_t))
-#define BLOCK_MAX_POINTERS (BLOCK_SIZE / sizeof(blkoff_t))
+// Chosen so a directory entry is 256 bytes and never straddles blocks
+#define NAME_LIMIT 248
+#define CACHE_LINE_SIZE 64
+// Most backing files an image can be spread across
+#define MAX_FILES 16
+#define DEFAULT_STRIPE_SIZE (64 * 1024)
 #define END_BLOCKS -1
 #define END_NODES -1
+// How many nodes may have unflushed lazytime timestamps before we write them back.
+#define LAZYTIME_BATCH 1024
+
+// Flags for tfs_load()
+#define TFS_NOATIME (1 << 0)
+#define TFS_RELATIME (1 << 1)
+#define TFS_LAZYTIME (1 << 2)
+#define TFS_RDONLY (1 << 3)
+
+// Node flags
+// Some data blocks may be shared with clones, check their reference counts before writing or freeing.
+#define TFS_NODE_SHARED (1 << 0)
+// Part of a snapshot, never changed.
+#define TFS_NODE_IMMUTABLE (1 << 1)
+
+// Snapshots are kept in here, named after their snapshot.
+#define SNAPSHOT_DIR "/.snapshots"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 // Absolute node size
-#define NODE_SIZE(node) ((node)->mode & S_IFDIR ? (node)->nlink * sizeof(nodoff_t) : (node)->size)
-// Number required blocks for data (not including indirect pointer blocks)
-#define NODE_NRBLOCKS(node) ((BLOCK_SIZE + NODE_SIZE(node) - 1) / BLOCK_SIZE)
+#define NODE_SIZE(node) ((node)->mode & S_IFDIR ? (node)->nlink * sizeof(struct tfs_dirent) : (node)->size)
+
+/**
+ * A range of blocks striped across consecutive backing files.
+ *
+ * Images start with one segment covering all files, growing an image adds another.
+ */
+struct tfs_segment {
+	blkoff_t first, nblocks;
+	int first_file, nfiles;
+};
 
 /**
  * TFS superblock:
  * Metadata needed to calculate everything.
+ *
+ * Lives at the start of the first backing file, which also holds the node tables.
  */
 struct tfs_header {
+	// log2 of the block size
+	int block_nbits;
+	// log2 of the stripe width in blocks
+	int stripe_nbits;
+	int nfiles, nsegments;
+	off_t filesizes[MAX_FILES];
+	struct tfs_segment segments[MAX_FILES];
 	blkoff_t nblocks, free_block_head;
 	nodoff_t nnodes, free_node_head;
+	// Kept up to date on every (de)allocation so statfs never walks the free lists.
+	blkoff_t free_blocks;
+	nodoff_t free_nodes;
+	// Bumped by every export, nodes changed since are tagged with the new value.
+	uint64_t generation;
+	// Hidden node holding the path lookup index for read-only mounts, END_NODES if none.
+	nodoff_t index_node;
+	// Hidden node holding a uint32_t per block with how many more nodes share it, END_NODES until the first clone.
+	nodoff_t refs_node;
 };
 
 /**
  * The TFS node, as it is represented in the image file.
+ *
+ * Only what getattr and friends need, so each node fits in one cache line.
+ * Block pointers live in a separate table and names in the directory entries.
  */
 struct tfs_node {
 	union {
 		struct {
 			mode_t mode;
-			char name[NAME_LIMIT];
-			// Direct blocks
-			blkoff_t blocks[DIRECT_BLOCKS];
-			// Indirect blocks
-			blkoff_t iblocks[ILEVELS];
+			// TFS_NODE_* flags
+			uint32_t flags;
 			// Number of allocated blocks
 			fsblkcnt_t nblocks;
 			// Number of links of directory, file size otherwise
@@ -59,6 +113,103 @@ struct tfs_node {
 		// Used for free node linked list.
 		nodoff_t next;
 	};
+	// Generation this node last changed in, kept when the node is freed.
+	uint64_t gen;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * Block pointers of a node, indexed the same as the node table.
+ */
+struct tfs_node_pointers {
+	// Direct blocks
+	blkoff_t blocks[DIRECT_BLOCKS];
+	// Indirect blocks
+	blkoff_t iblocks[ILEVELS];
+};
+
+/**
+ * Directory entry, the data of directories is an array of these.
+ */
+struct tfs_dirent {
+	nodoff_t node;
+	char name[NAME_LIMIT];
+};
+
+/**
+ * Start of the lookup index: an open addressing hash table of paths, followed by the paths themselves.
+ */
+struct tfs_index_header {
+	// Power of 2
+	uint64_t nslots;
+};
+
+struct tfs_index_slot {
+	uint64_t hash;
+	// END_NODES for empty slots
+	nodoff_t node;
+	// Offset of the NUL terminated path within the index
+	uint64_t path;
+};
+
+/**
+ * Argument of the TFS ioctls, a path within the filesystem or a snapshot name.
+ */
+struct tfs_ioctl_path {
+	char path[PATH_MAX];
+};
+
+// Clone the file the ioctl is issued on to a new path.
+#define TFS_IOC_CLONE _IOW('T', 1, struct tfs_ioctl_path)
+// Take a snapshot of the whole filesystem.
+#define TFS_IOC_SNAPSHOT _IOW('T', 2, struct tfs_ioctl_path)
+// Delete a snapshot.
+#define TFS_IOC_SNAPSHOT_DELETE _IOW('T', 3, struct tfs_ioctl_path)
+
+#define EXPORT_MAGIC "TFSXPORT"
+#define EXPORT_VERSION 1
+
+/**
+ * Header of an export stream, followed by the TFS superblock and records.
+ */
+struct tfs_export_header {
+	char magic[8];
+	uint32_t version;
+	// Whether only nodes changed after generation `since` are included.
+	uint32_t incremental;
+	uint64_t since;
+	off_t filesize;
+} __attribute__((packed));
+
+enum tfs_export_type {
+	// Followed by a struct tfs_node and its struct tfs_node_pointers.
+	EXPORT_NODE,
+	// Followed by the block data.
+	EXPORT_BLOCK,
+	EXPORT_END,
+};
+
+struct tfs_export_record {
+	uint32_t type;
+	// Node or block number.
+	int64_t index;
+} __attribute__((packed));
+
+/**
+ * In-memory copy of node timestamps for lazytime.
+ */
+struct tfs_times {
+	struct timespec atim, mtim;
+	int dirty;
+};
+
+/**
+ * A mapped backing file.
+ */
+struct tfs_file {
+	void *base;
+	off_t size;
+	// Where its blocks start
+	char *data;
 };
 
 /**
@@ -67,34 +218,82 @@ struct tfs_node {
 struct tfs_info {
 	blkoff_t nblocks;
 	nodoff_t nnodes;
+	// Block geometry, all powers of 2 and their log2s for shifting.
+	size_t block_size, max_pointers, max_children;
+	int block_nbits, max_pointers_nbits, stripe_nbits;
+	struct tfs_segment *segments;
 	blkoff_t *free_block_head;
 	nodoff_t *free_node_head;
+	blkoff_t *free_blocks;
+	nodoff_t *free_nodes;
+	uint64_t *generation;
+	nodoff_t *index_node;
+	nodoff_t *refs_node;
+	// Index used for lookups instead of the hash table, NULL if none.
+	struct tfs_node *index;
+	uint64_t index_nslots;
 	struct tfs_node *nodes;
-	char (*data)[BLOCK_SIZE];
+	struct tfs_node_pointers *pointers;
+	char *data;
+	int flags;
+	// Lazytime timestamps and the nodes that have them.
+	struct tfs_times *lazy;
+	nodoff_t lazy_dirty[LAZYTIME_BATCH];
+	int nlazy;
 	/* no touchy */
 	void *base;
 	off_t filesize;
+	struct tfs_file files[MAX_FILES];
+	int nfiles;
 };
 
 /**
  * Open a file as a TFS image.
+ *
+ * Images striped across several files are given as a colon separated list, in order.
  */
 int tfs_open(const char *filename);
 
 /**
  * Open and initialize a TFS image.
+ *
+ * `flags` is a combination of TFS_NOATIME, TFS_RELATIME, TFS_LAZYTIME and TFS_RDONLY.
+ * Read-only images are mapped read-only, never written to, and use the lookup index if they have one.
  */
-int tfs_load(const char *filename);
+int tfs_load(const char *filename, int flags);
 
 /**
  * Format a TFS image.
+ *
+ * `block_size` must be a power of 2 between MIN_BLOCK_SIZE and MAX_BLOCK_SIZE.
+ * `stripe_size` is how much goes to one file before moving on to the next, a power of 2 of at least `block_size`.
  */
-void tfs_format();
+int tfs_format(size_t block_size, size_t stripe_size);
+
+/**
+ * Add capacity to an opened image by striping more blocks across new files.
+ */
+int tfs_grow(const char *filenames);
 
 /**
  * Calculate pointers and other useful things.
+ *
+ * Fails if the opened files do not match the ones the image was formatted with.
+ */
+int tfs_init();
+
+/**
+ * Build the lookup index of an image opened with tfs_open(), replacing any previous one.
+ *
+ * Read-only mounts of the image then share the index instead of each building a hash table.
+ * Any change to the image paths drops the index again.
+ */
+int tfs_build_index();
+
+/**
+ * Write lazytime timestamps back to the image.
  */
-void tfs_init();
+void tfs_flush_times();
 
 /**
  * Write back any "queued" changes.
@@ -108,6 +307,11 @@ int tfs_destroy();
  */
 int tfs_node_trim(struct tfs_node *node);
 
+/**
+ * Fill in filesystem statistics.
+ */
+void tfs_statfs(struct statvfs *stbuf);
+
 /**
  * Get a node from the hash table given the path.
  */
@@ -119,11 +323,26 @@ struct tfs_node *get_node(const char *path);
 struct tfs_node *get_directory(const char *path);
 
 /**
- * Collect children of a node into one contiguous array.
+ * Collect the directory entries of a node into one contiguous array of `nlink` entries.
  *
  * The array must be freed when you are done with it.
  */
-struct tfs_node **tfs_node_children(struct tfs_node *node);
+struct tfs_dirent *tfs_node_children(struct tfs_node *node);
+
+/**
+ * Get node timestamps, including ones not yet flushed.
+ */
+void tfs_node_times(struct tfs_node *node, struct timespec *atim, struct timespec *mtim);
+
+/**
+ * Set node timestamps.
+ */
+int tfs_node_utimens(struct tfs_node *node, const struct timespec tv[2]);
+
+/**
+ * Set the size of a file.
+ */
+int tfs_node_truncate(struct tfs_node *node, off_t size);
 
 /**
  * Read node data.
@@ -135,6 +354,36 @@ int tfs_node_read(struct tfs_node *node, char *buf, size_t size, off_t offset);
  */
 int tfs_node_write(struct tfs_node *node, const char *buf, size_t size, off_t offset);
 
+/**
+ * Get the data of block `i` of a node for direct access.
+ *
+ * `*count` is set to how many blocks, starting from `i`, are contiguous in memory, up to `max`.
+ * Only reads metadata, so it is safe to call concurrently as long as nothing is (de)allocated.
+ * Blocks of clones are shared, so only write through this to nodes that were never cloned.
+ */
+char *tfs_node_map(struct tfs_node *node, blkoff_t i, blkoff_t max, blkoff_t *count);
+
+/**
+ * Block size of the loaded image.
+ */
+size_t tfs_block_size();
+
+/**
+ * Write the image opened with tfs_open() to a stream.
+ *
+ * Free nodes and blocks are left out. If `incremental` is set, only nodes changed after generation `since`
+ * are included, freed ones too. The image generation is bumped afterwards and the exported one returned in `*generation`.
+ */
+int tfs_export(FILE *out, int incremental, uint64_t since, uint64_t *generation);
+
+/**
+ * Apply an export stream to an image file.
+ *
+ * A full export recreates the image, an incremental one must be applied on top of the
+ * image restored from the export it was taken since.
+ */
+int tfs_restore(FILE *in, const char *filename);
+
 /**
  * Add a node.
  */
@@ -145,4 +394,23 @@ int tfs_add_node(const char *path, mode_t mode);
  */
 int tfs_remove_node(const char *path);
 
+/**
+ * Clone a file to a new path without copying its data.
+ *
+ * Both files share the data blocks until either is written to, only the block pointers are copied.
+ */
+int tfs_clone(const char *src, const char *dst);
+
+/**
+ * Take a read-only snapshot of the whole filesystem, found under SNAPSHOT_DIR/`name`.
+ *
+ * Every file is cloned, so this costs a node per file and no data blocks.
+ */
+int tfs_snapshot(const char *name);
+
+/**
+ * Delete a snapshot taken with tfs_snapshot().
+ */
+int tfs_snapshot_delete(const char *name);
+
 #endif // TFS_H
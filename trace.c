@@ -0,0 +1,105 @@
+#include "trace.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+// Big buffer so recording costs a memcpy most of the time.
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+const char *tfs_trace_op_names[TRACE_NOPS] = {
+    [TRACE_GETATTR] = "getattr",
+    [TRACE_MKNOD] = "mknod",
+    [TRACE_MKDIR] = "mkdir",
+    [TRACE_UNLINK] = "unlink",
+    [TRACE_RMDIR] = "rmdir",
+    [TRACE_TRUNCATE] = "truncate",
+    [TRACE_OPEN] = "open",
+    [TRACE_READ] = "read",
+    [TRACE_WRITE] = "write",
+    [TRACE_RELEASE] = "release",
+    [TRACE_READDIR] = "readdir",
+    [TRACE_STATFS] = "statfs",
+    [TRACE_UTIMENS] = "utimens",
+    [TRACE_FSYNC] = "fsync",
+    [TRACE_CLONE] = "clone",
+    [TRACE_SNAPSHOT] = "snapshot",
+    [TRACE_SNAPSHOT_DELETE] = "snapdelete",
+};
+
+static FILE *trace_file;
+static uint64_t trace_start;
+
+uint64_t tfs_trace_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int tfs_trace_open(const char *filename) {
+	struct tfs_trace_header header = {.magic = TRACE_MAGIC, .version = TRACE_VERSION};
+
+	trace_file = fopen(filename, "w");
+	if (!trace_file)
+		return -errno;
+
+	setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+	fwrite(&header, sizeof(header), 1, trace_file);
+	trace_start = tfs_trace_now();
+
+	return 0;
+}
+
+void tfs_trace_record(enum tfs_trace_op op, const char *path, uint64_t arg, int64_t offset, uint64_t start, int ret) {
+	uint64_t end = tfs_trace_now();
+	struct tfs_trace_record record = {
+	    .op = op,
+	    .pathlen = strlen(path),
+	    .ret = ret,
+	    .arg = arg,
+	    .offset = offset,
+	    .start = start - trace_start,
+	    .duration = end - start,
+	};
+
+	// FUSE may call us from several threads; keep record and path together.
+	flockfile(trace_file);
+	fwrite_unlocked(&record, sizeof(record), 1, trace_file);
+	fwrite_unlocked(path, 1, record.pathlen, trace_file);
+	funlockfile(trace_file);
+}
+
+void tfs_trace_close() {
+	if (trace_file)
+		fclose(trace_file);
+	trace_file = NULL;
+}
+
+FILE *tfs_trace_read_open(const char *filename) {
+	struct tfs_trace_header header;
+	FILE *trace = fopen(filename, "r");
+	if (!trace)
+		return NULL;
+
+	if (fread(&header, sizeof(header), 1, trace) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+	    header.version != TRACE_VERSION) {
+		fclose(trace);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return trace;
+}
+
+int tfs_trace_read(FILE *trace, struct tfs_trace_record *record, char *path) {
+	if (fread(record, sizeof(*record), 1, trace) != 1)
+		return 0;
+	if (record->op >= TRACE_NOPS || record->pathlen >= TRACE_PATH_MAX)
+		return -1;
+	if (fread(path, 1, record->pathlen, trace) != record->pathlen)
+		return -1;
+
+	path[record->pathlen] = '\0';
+
+	return 1;
+}
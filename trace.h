@@ -0,0 +1,97 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC "TFSTRACE"
+#define TRACE_VERSION 2
+// Longest path of a record, clones have two.
+#define TRACE_PATH_MAX (2 * PATH_MAX)
+
+/**
+ * Traced operations.
+ */
+enum tfs_trace_op {
+	TRACE_GETATTR,
+	TRACE_MKNOD,
+	TRACE_MKDIR,
+	TRACE_UNLINK,
+	TRACE_RMDIR,
+	TRACE_TRUNCATE,
+	TRACE_OPEN,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_RELEASE,
+	TRACE_READDIR,
+	TRACE_STATFS,
+	TRACE_UTIMENS,
+	TRACE_FSYNC,
+	TRACE_CLONE,
+	TRACE_SNAPSHOT,
+	TRACE_SNAPSHOT_DELETE,
+	TRACE_NOPS,
+};
+
+extern const char *tfs_trace_op_names[TRACE_NOPS];
+
+/**
+ * Trace file header.
+ */
+struct tfs_trace_header {
+	char magic[8];
+	uint32_t version;
+} __attribute__((packed));
+
+/**
+ * One traced operation, followed by `pathlen` bytes of path in the trace file.
+ *
+ * Clones have the source path followed by the destination path, snapshots the snapshot name.
+ */
+struct tfs_trace_record {
+	uint8_t op;
+	uint16_t pathlen;
+	int32_t ret;
+	// Size for read/write/truncate, mode for mknod/mkdir, length of the source path for clone.
+	uint64_t arg;
+	int64_t offset;
+	// Nanoseconds since the trace was started.
+	uint64_t start;
+	// Nanoseconds the operation took.
+	uint64_t duration;
+} __attribute__((packed));
+
+/**
+ * Monotonic time in nanoseconds.
+ */
+uint64_t tfs_trace_now();
+
+/**
+ * Start recording to a file.
+ */
+int tfs_trace_open(const char *filename);
+
+/**
+ * Record an operation that started at `start` (see tfs_trace_now()) and just finished.
+ */
+void tfs_trace_record(enum tfs_trace_op op, const char *path, uint64_t arg, int64_t offset, uint64_t start, int ret);
+
+/**
+ * Stop recording.
+ */
+void tfs_trace_close();
+
+/**
+ * Open a trace file for reading.
+ */
+FILE *tfs_trace_read_open(const char *filename);
+
+/**
+ * Read the next record and its path into `path`, which must hold TRACE_PATH_MAX bytes.
+ *
+ * Returns 1 on success, 0 at the end of the trace and -1 on a malformed record.
+ */
+int tfs_trace_read(FILE *trace, struct tfs_trace_record *record, char *path);
+
+#endif // TRACE_H